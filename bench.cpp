@@ -0,0 +1,305 @@
+// Times every stage of the renderer (OBJ load, texture decode, vertex, raster, AO, encode) on generated scenes,
+// writes the timings as JSON and optionally flags the regressions against a stored baseline.
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "tgaimage.h"
+#include "model.h"
+#include "scheduler.h"
+#include "linalg.h"
+#include "our_gl.h"
+
+struct Options {
+    std::string out = {};
+    std::string baseline = {};
+    double threshold = .1;     // relative slowdown reported as a regression
+    double noise_floor = .5;   // ms, smaller absolute slowdowns are ignored
+    int repeat = 3;
+    int size = 512;
+    int ao_samples = 64;
+    bool quick = false;
+};
+
+struct Scene {
+    std::string name;
+    std::string obj;
+    std::string texture = {}; // empty for the untextured scenes
+    int samples = 1;          // MSAA samples per pixel
+    int scale = 1;            // SSAA: rendered scale times larger per axis, then box-filtered down
+};
+
+struct FlatShader : IShader {
+    virtual std::pair<bool, TGAColor> fragment(const int, const vec3 bar) const {
+        return {false, {255, 255, 255, 255}};
+    }
+};
+
+struct TextureShader : IShader {
+    const Model &model;
+    const TGAImage &texture;
+
+    TextureShader(const Model &m, const TGAImage &tex) : model(m), texture(tex) {}
+
+    virtual std::pair<bool, TGAColor> fragment(const int face, const vec3 bar) const {
+        assert(face >= 0 && "TextureShader reads its uvs by face index, draw it with the batched rasterize()");
+        vec2 uv = model.uv(face, 0) * bar.x + model.uv(face, 1) * bar.y + model.uv(face, 2) * bar.z;
+        return {false, sample2D(texture, uv)};
+    }
+};
+
+// a UV sphere of 4*n*n triangles, the texture seam gets its own column of uvs
+static void write_sphere(const std::string &path, const int n) {
+    std::ofstream out(path);
+    for (int i = 0; i <= n; i++)
+        for (int j = 0; j < 2 * n; j++) {
+            double theta = M_PI * i / n, phi = M_PI * j / n;
+            out << "v " << .8 * std::sin(theta) * std::cos(phi) << " " << .8 * std::cos(theta) << " " << .8 * std::sin(theta) * std::sin(phi) << "\n";
+        }
+    for (int i = 0; i <= n; i++)
+        for (int j = 0; j <= 2 * n; j++)
+            out << "vt " << j / (2. * n) << " " << 1. - static_cast<double>(i) / n << "\n";
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < 2 * n; j++) {
+            int a = i * 2 * n + j + 1, b = i * 2 * n + (j + 1) % (2 * n) + 1, c = a + 2 * n, d = b + 2 * n;
+            int ta = i * (2 * n + 1) + j + 1, tb = ta + 1, tc = ta + 2 * n + 1, td = tc + 1;
+            out << "f " << a << "/" << ta << " " << c << "/" << tc << " " << b << "/" << tb << "\n";
+            out << "f " << b << "/" << tb << " " << c << "/" << tc << " " << d << "/" << td << "\n";
+        }
+}
+
+// screen-filling quads drawn back to front, every layer passes the depth test and gets shaded
+static void write_stack(const std::string &path, const int layers) {
+    std::ofstream out(path);
+    for (int l = 0; l < layers; l++) {
+        double z = -.5 + static_cast<double>(l) / layers;
+        out << "v -1 -1 " << z << "\nv 1 -1 " << z << "\nv 1 1 " << z << "\nv -1 1 " << z << "\n";
+    }
+    for (int l = 0; l < layers; l++)
+        out << "f " << 4 * l + 1 << " " << 4 * l + 2 << " " << 4 * l + 3 << "\nf " << 4 * l + 1 << " " << 4 * l + 3 << " " << 4 * l + 4 << "\n";
+}
+
+static void write_texture(const std::string &path, const int size) {
+    TGAImage texture(size, size, TGAImage::RGB);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++) { // checkerboard with a gradient, so that RLE cannot collapse the rows
+            std::uint8_t check = ((x / 64 + y / 64) % 2) ? 255 : 64;
+            texture.set(x, y, {check, static_cast<std::uint8_t>(x * 255 / size), static_cast<std::uint8_t>(y * 255 / size), 255});
+        }
+    texture.write_tga_file(path);
+}
+
+static TGAImage downsample(const TGAImage &img, const int scale) {
+    TGAImage ret(img.width() / scale, img.height() / scale, TGAImage::RGB);
+    for (int y = 0; y < ret.height(); y++)
+        for (int x = 0; x < ret.width(); x++) {
+            int sum[4] = {0, 0, 0, 0};
+            for (int j = 0; j < scale; j++)
+                for (int i = 0; i < scale; i++) {
+                    TGAColor c = img.get(x * scale + i, y * scale + j);
+                    for (int k = 0; k < 4; k++) sum[k] += c[k];
+                }
+            TGAColor c;
+            for (int k = 0; k < 4; k++) c[k] = sum[k] / (scale * scale);
+            ret.set(x, y, c);
+        }
+    return ret;
+}
+
+template<typename F> double time_ms(F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// one pass over the stages of the renderer, returns the milliseconds spent in each stage
+static std::map<std::string, double> run_scene(const Scene &scene, const Options &opt, const std::string &output) {
+    std::map<std::string, double> ms;
+    Model model;
+    TGAImage texture;
+    ms["load"] = time_ms([&] { model.load(scene.obj); });
+    if (!scene.texture.empty())
+        ms["decode"] = time_ms([&] { texture.read_tga_file(scene.texture); });
+
+    constexpr vec3    eye{0, 0, 2};
+    constexpr vec3 center{0, 0, 0};
+    constexpr vec3     up{0, 1, 0};
+    lookat(eye, center, up);
+    init_perspective(norm(eye - center));
+    const int size = opt.size * scene.scale;
+    init_viewport(size / 16, size / 16, size * 7 / 8, size * 7 / 8);
+    init_zbuffer(size, size, scene.samples);
+    TGAImage framebuffer(size, size, TGAImage::RGB, {177, 195, 209, 255});
+
+    FlatShader flat;
+    TextureShader textured(model, texture);
+    const IShader &shader = scene.texture.empty() ? static_cast<const IShader &>(flat) : textured;
+    std::vector<Triangle> clips;
+    ms["vertex"] = ms["raster"] = 0;
+    for (int first = 0; first < model.nfaces(); first += raster_batch) { // batched the same way as in main.cpp
+        ms["vertex"] += time_ms([&] {
+            vertex_stage(shader, first, std::min(raster_batch, model.nfaces() - first), clips,
+                         [&](const int f, const int v) { return model.vert(f, v); });
+        });
+        ms["raster"] += time_ms([&] { rasterize(clips, shader, framebuffer, first); });
+    }
+
+    if (scene.samples > 1 || scene.scale > 1) { // the anti-aliasing scenes compare the raster and resolve costs only
+        ms["resolve"] = time_ms([&] {
+            resolve_msaa(framebuffer);
+            if (scene.scale > 1) framebuffer = downsample(framebuffer, scene.scale);
+        });
+        return ms;
+    }
+
+    ms["ao"] = time_ms([&] { ambient_occlusion(framebuffer, .1, opt.ao_samples, 42); });
+    ms["encode"] = time_ms([&] { framebuffer.write_tga_file(output); });
+    return ms;
+}
+
+static std::map<std::string, double> read_baseline(const std::string &path) {
+    std::map<std::string, double> ret;
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "can't open file " << path << "\n";
+        return ret;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string text = ss.str();
+    size_t results = text.find("\"results\"");
+    if (results == std::string::npos) return ret;
+    const std::regex entry("\"([^\"]+)\"\\s*:\\s*([-+0-9.eE]+)");
+    for (auto it = std::sregex_iterator(text.begin() + results, text.end(), entry); it != std::sregex_iterator(); ++it)
+        ret[(*it)[1]] = std::stod((*it)[2]);
+    return ret;
+}
+
+// prints the comparison table, returns the number of regressions
+static int compare(const std::map<std::string, double> &baseline, const std::map<std::string, double> &results, const Options &opt) {
+    int regressions = 0;
+    std::cerr << std::left << std::setw(28) << "stage" << std::right << std::setw(12) << "baseline" << std::setw(12) << "current" << std::setw(10) << "change" << "\n";
+    for (const auto &[key, ms] : results) {
+        auto base = baseline.find(key);
+        if (base == baseline.end()) {
+            std::cerr << std::left << std::setw(28) << key << std::right << std::setw(12) << "-" << std::setw(12) << ms << "      new\n";
+            continue;
+        }
+        double change = base->second > 0 ? ms / base->second - 1 : 0;
+        bool regressed = change > opt.threshold && ms - base->second > opt.noise_floor;
+        regressions += regressed;
+        std::cerr << std::left << std::setw(28) << key << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << base->second << std::setw(12) << ms << std::setw(9) << std::setprecision(1) << change * 100 << "%"
+                  << (regressed ? "  REGRESSION" : "") << "\n" << std::defaultfloat << std::setprecision(6);
+    }
+    for (const auto &[key, ms] : baseline)
+        if (!results.count(key)) std::cerr << std::left << std::setw(28) << key << "  missing from the current run\n";
+    return regressions;
+}
+
+static void usage(const char *name) {
+    std::cout << "usage: " << name << " [options]\n"
+              << "  --out FILE        write the JSON results to FILE instead of stdout\n"
+              << "  --compare FILE    flag the stages slower than the baseline JSON in FILE, exit code 1 on regression\n"
+              << "  --threshold X     relative slowdown counted as a regression (default .1)\n"
+              << "  --noise-floor MS  ignore slowdowns smaller than MS milliseconds (default .5)\n"
+              << "  --repeat N        keep the fastest of N runs per scene (default 3)\n"
+              << "  --size N          framebuffer size in pixels (default 512)\n"
+              << "  --ao-samples N    SSAO samples per pixel (default 64)\n"
+              << "  --quick           only the smaller scenes\n";
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--out" && has_value) opt.out = argv[++i];
+        else if (arg == "--compare" && has_value) opt.baseline = argv[++i];
+        else if (arg == "--threshold" && has_value) opt.threshold = std::atof(argv[++i]);
+        else if (arg == "--noise-floor" && has_value) opt.noise_floor = std::atof(argv[++i]);
+        else if (arg == "--repeat" && has_value) opt.repeat = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--size" && has_value) opt.size = std::max(16, std::atoi(argv[++i]));
+        else if (arg == "--ao-samples" && has_value) opt.ao_samples = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--quick") opt.quick = true;
+        else {
+            usage(argv[0]);
+            return arg == "--help" || arg == "-h" ? 0 : 1;
+        }
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "tinyrenderer_bench";
+    std::filesystem::create_directories(dir);
+    std::vector<Scene> scenes;
+    for (int n : {16, 32, 64, 128, 256}) { // 1k to 256k faces
+        if (opt.quick && n > 64) break;
+        std::string name = "sphere_" + std::to_string(4 * n * n);
+        scenes.push_back({name, (dir / (name + ".obj")).string()});
+        write_sphere(scenes.back().obj, n);
+    }
+    { // the same anti-aliasing quality, by multisampling or by supersampling
+        std::string obj = (dir / "sphere_16384.obj").string();
+        scenes.push_back({"msaa_4", obj, {}, 4, 1});
+        scenes.push_back({"ssaa_4", obj, {}, 1, 2});
+    }
+    for (int layers : {16, 64}) {
+        if (opt.quick && layers > 16) break;
+        std::string name = "overdraw_" + std::to_string(layers);
+        scenes.push_back({name, (dir / (name + ".obj")).string()});
+        write_stack(scenes.back().obj, layers);
+    }
+    write_sphere((dir / "textured.obj").string(), 64);
+    for (int size : {1024, 4096}) {
+        if (opt.quick && size > 1024) break;
+        std::string name = "texture_" + std::to_string(size);
+        scenes.push_back({name, (dir / "textured.obj").string(), (dir / (name + ".tga")).string()});
+        write_texture(scenes.back().texture, size);
+    }
+
+    std::map<std::string, double> results;
+    for (const Scene &scene : scenes) {
+        std::cerr << scene.name << std::endl;
+        for (int r = 0; r < opt.repeat; r++) // the fastest run is the least disturbed by the rest of the system
+            for (const auto &[stage, ms] : run_scene(scene, opt, (dir / "framebuffer.tga").string())) {
+                auto [it, inserted] = results.try_emplace(scene.name + "." + stage, ms);
+                if (!inserted) it->second = std::min(it->second, ms);
+            }
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"config\": {\"size\": " << opt.size << ", \"ao_samples\": " << opt.ao_samples << ", \"repeat\": " << opt.repeat
+         << ", \"threads\": " << Scheduler::instance().nthreads() << "},\n  \"results\": {\n";
+    for (auto it = results.begin(); it != results.end(); ++it)
+        json << "    \"" << it->first << "\": " << it->second << (std::next(it) == results.end() ? "\n" : ",\n");
+    json << "  }\n}\n";
+    if (opt.out.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream out(opt.out);
+        out << json.str();
+        if (!out.good()) {
+            std::cerr << "can't write " << opt.out << "\n";
+            return 1;
+        }
+    }
+
+    if (opt.baseline.empty()) return 0;
+    std::map<std::string, double> baseline = read_baseline(opt.baseline);
+    if (baseline.empty()) {
+        std::cerr << "no results in the baseline " << opt.baseline << "\n";
+        return 1;
+    }
+    int regressions = compare(baseline, results, opt);
+    std::cerr << regressions << " regression(s)" << std::endl;
+    return regressions ? 1 : 0;
+}
@@ -2,42 +2,46 @@
 #include <cmath>
 #include <cassert>
 #include <iostream>
+#include <type_traits>
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
 
 template<int n> struct vec {
     double data[n] = {0};
-    double& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
-    double  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<n); return data[i]; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<n); return data[i]; }
 };
 
-template<int n> double operator*(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr double operator*(const vec<n>& lhs, const vec<n>& rhs) {
     double ret = 0;                         // N.B. Do not ever, ever use such for loops! They are highly confusing.
     for (int i=n; i--; ret+=lhs[i]*rhs[i]); // Here I used them as a tribute to old-school game programmers fighting for every CPU cycle.
     return ret;                             // Once upon a time reverse loops were faster than the normal ones, it is not the case anymore.
 }
 
-template<int n> vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr vec<n> operator+(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]+=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
+template<int n> constexpr vec<n> operator-(const vec<n>& lhs, const vec<n>& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]-=rhs[i]);
     return ret;
 }
 
-template<int n> vec<n> operator*(const vec<n>& lhs, const double& rhs) {
+template<int n> constexpr vec<n> operator*(const vec<n>& lhs, const double& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]*=rhs);
     return ret;
 }
 
-template<int n> vec<n> operator*(const double& lhs, const vec<n> &rhs) {
+template<int n> constexpr vec<n> operator*(const double& lhs, const vec<n> &rhs) {
     return rhs * lhs;
 }
 
-template<int n> vec<n> operator/(const vec<n>& lhs, const double& rhs) {
+template<int n> constexpr vec<n> operator/(const vec<n>& lhs, const double& rhs) {
     vec<n> ret = lhs;
     for (int i=n; i--; ret[i]/=rhs);
     return ret;
@@ -50,22 +54,22 @@ template<int n> std::ostream& operator<<(std::ostream& out, const vec<n>& v) {
 
 template<> struct vec<2> {
     double x = 0, y = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<2); return i ? y : x; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<2); return i ? y : x; }
 };
 
 template<> struct vec<3> {
     double x = 0, y = 0, z = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
-    double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<3); return i ? (1==i ? y : z) : x; }
 };
 
 template<> struct vec<4> {
     double x = 0, y = 0, z = 0, w = 0;
-    double& operator[](const int i)       { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
-    double  operator[](const int i) const { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
-    vec<2> xy()  const { return {x, y};    }
-    vec<3> xyz() const { return {x, y, z}; }
+    constexpr double& operator[](const int i)       { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
+    constexpr double  operator[](const int i) const { assert(i>=0 && i<4); return i<2 ? (i ? y : x) : (2==i ? z : w); }
+    constexpr vec<2> xy()  const { return {x, y};    }
+    constexpr vec<3> xyz() const { return {x, y, z}; }
 };
 
 typedef vec<2> vec2;
@@ -80,7 +84,7 @@ template<int n> vec<n> normalized(const vec<n>& v) {
     return v / norm(v);
 }
 
-inline vec3 cross(const vec3 &v1, const vec3 &v2) {
+constexpr vec3 cross(const vec3 &v1, const vec3 &v2) {
     return {v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x};
 }
 
@@ -89,32 +93,66 @@ template<int n> struct dt;
 template<int nrows,int ncols> struct mat {
     vec<ncols> rows[nrows] = {{}};
 
-          vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
-    const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr       vec<ncols>& operator[] (const int idx)       { assert(idx>=0 && idx<nrows); return rows[idx]; }
+    constexpr const vec<ncols>& operator[] (const int idx) const { assert(idx>=0 && idx<nrows); return rows[idx]; }
 
-    double det() const {
+    constexpr double det() const {
         return dt<ncols>::det(*this);
     }
 
-    double cofactor(const int row, const int col) const {
+    constexpr double cofactor(const int row, const int col) const {
         mat<nrows-1,ncols-1> submatrix;
         for (int i=nrows-1; i--; )
             for (int j=ncols-1;j--; submatrix[i][j]=rows[i+int(i>=row)][j+int(j>=col)]);
         return submatrix.det() * ((row+col)%2 ? -1 : 1);
     }
 
-    mat<nrows,ncols> invert_transpose() const {
-        mat<nrows,ncols> adjugate_transpose; // transpose to ease determinant computation, check the last line
-        for (int i=nrows; i--; )
-            for (int j=ncols; j--; adjugate_transpose[i][j]=cofactor(i,j));
-        return adjugate_transpose/(adjugate_transpose[0]*rows[0]);
+    constexpr mat<nrows,ncols> invert_transpose() const {
+        if constexpr (nrows==2 && ncols==2) {
+            return mat<2,2>{{{rows[1][1], -rows[1][0]}, {-rows[0][1], rows[0][0]}}} / det();
+        } else if constexpr (nrows==3 && ncols==3) {
+            mat<3,3> cof = {{cross(rows[1], rows[2]), cross(rows[2], rows[0]), cross(rows[0], rows[1])}}; // the cofactor matrix, row by row
+            return cof/(cof[0]*rows[0]);
+        } else if constexpr (nrows==4 && ncols==4) {
+            return invert().transpose();
+        } else {
+            mat<nrows,ncols> adjugate_transpose; // transpose to ease determinant computation, check the last line
+            for (int i=nrows; i--; )
+                for (int j=ncols; j--; adjugate_transpose[i][j]=cofactor(i,j));
+            return adjugate_transpose/(adjugate_transpose[0]*rows[0]);
+        }
     }
 
-    mat<nrows,ncols> invert() const {
-        return invert_transpose().transpose();
+    constexpr mat<nrows,ncols> invert() const {
+        if constexpr (nrows==4 && ncols==4) { // closed form: the 4x4 cofactors share 2x2 minors of the top and bottom row pairs
+            const vec4 &a = rows[0], &b = rows[1], &c = rows[2], &d = rows[3];
+            double s0 = a.x*b.y - b.x*a.y, s1 = a.x*b.z - b.x*a.z, s2 = a.x*b.w - b.x*a.w;
+            double s3 = a.y*b.z - b.y*a.z, s4 = a.y*b.w - b.y*a.w, s5 = a.z*b.w - b.z*a.w;
+            double c5 = c.z*d.w - d.z*c.w, c4 = c.y*d.w - d.y*c.w, c3 = c.y*d.z - d.y*c.z;
+            double c2 = c.x*d.w - d.x*c.w, c1 = c.x*d.z - d.x*c.z, c0 = c.x*d.y - d.x*c.y;
+            double det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+            mat<nrows,ncols> adjugate = {{{ b.y*c5 - b.z*c4 + b.w*c3, -a.y*c5 + a.z*c4 - a.w*c3,  d.y*s5 - d.z*s4 + d.w*s3, -c.y*s5 + c.z*s4 - c.w*s3},
+                                          {-b.x*c5 + b.z*c2 - b.w*c1,  a.x*c5 - a.z*c2 + a.w*c1, -d.x*s5 + d.z*s2 - d.w*s1,  c.x*s5 - c.z*s2 + c.w*s1},
+                                          { b.x*c4 - b.y*c2 + b.w*c0, -a.x*c4 + a.y*c2 - a.w*c0,  d.x*s4 - d.y*s2 + d.w*s0, -c.x*s4 + c.y*s2 - c.w*s0},
+                                          {-b.x*c3 + b.y*c1 - b.z*c0,  a.x*c3 - a.y*c1 + a.z*c0, -d.x*s3 + d.y*s1 - d.z*s0,  c.x*s3 - c.y*s1 + c.z*s0}}};
+            return adjugate/det;
+        } else {
+            return invert_transpose().transpose();
+        }
     }
 
-    mat<ncols,nrows> transpose() const {
+    constexpr mat<4,4> invert_affine() const { // fast path for transforms whose last row is (0,0,0,1): invert the 3x3 part, then the translation
+        static_assert(nrows==4 && ncols==4);
+        assert(rows[3][0]==0 && rows[3][1]==0 && rows[3][2]==0 && rows[3][3]==1);
+        mat<3,3> linear = mat<3,3>{{rows[0].xyz(), rows[1].xyz(), rows[2].xyz()}}.invert();
+        vec3 t = {rows[0].w, rows[1].w, rows[2].w};
+        return {{{linear[0].x, linear[0].y, linear[0].z, -(linear[0]*t)},
+                 {linear[1].x, linear[1].y, linear[1].z, -(linear[1]*t)},
+                 {linear[2].x, linear[2].y, linear[2].z, -(linear[2]*t)},
+                 {0, 0, 0, 1}}};
+    }
+
+    constexpr mat<ncols,nrows> transpose() const {
         mat<ncols,nrows> ret;
         for (int i=ncols; i--; )
             for (int j=nrows; j--; ret[i][j]=rows[j][i]);
@@ -122,17 +160,17 @@ template<int nrows,int ncols> struct mat {
     }
 };
 
-template<int nrows,int ncols> vec<ncols> operator*(const vec<nrows>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr vec<ncols> operator*(const vec<nrows>& lhs, const mat<nrows,ncols>& rhs) {
     return (mat<1,nrows>{{lhs}}*rhs)[0];
 }
 
-template<int nrows,int ncols> vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
+template<int nrows,int ncols> constexpr vec<nrows> operator*(const mat<nrows,ncols>& lhs, const vec<ncols>& rhs) {
     vec<nrows> ret;
     for (int i=nrows; i--; ret[i]=lhs[i]*rhs);
     return ret;
 }
 
-template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
+template<int R1,int C1,int C2> constexpr mat<R1,C2> operator*(const mat<R1,C1>& lhs, const mat<C1,C2>& rhs) {
     mat<R1,C2> result;
     for (int i=R1; i--; )
         for (int j=C2; j--; )
@@ -140,26 +178,26 @@ template<int R1,int C1,int C2>mat<R1,C2> operator*(const mat<R1,C1>& lhs, const
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator*(const mat<nrows,ncols>& lhs, const double& val) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]*val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator/(const mat<nrows,ncols>& lhs, const double& val) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; result[i] = lhs[i]/val);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator+(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]+rhs[i][j]);
     return result;
 }
 
-template<int nrows,int ncols>mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
+template<int nrows,int ncols> constexpr mat<nrows,ncols> operator-(const mat<nrows,ncols>& lhs, const mat<nrows,ncols>& rhs) {
     mat<nrows,ncols> result;
     for (int i=nrows; i--; )
         for (int j=ncols; j--; result[i][j]=lhs[i][j]-rhs[i][j]);
@@ -172,7 +210,7 @@ template<int nrows,int ncols> std::ostream& operator<<(std::ostream& out, const
 }
 
 template<int n> struct dt { // template metaprogramming to compute the determinant recursively
-    static double det(const mat<n,n>& src) {
+    static constexpr double det(const mat<n,n>& src) {
         double ret = 0;
         for (int i=n; i--; ret += src[0][i] * src.cofactor(0,i));
         return ret;
@@ -180,7 +218,94 @@ template<int n> struct dt { // template metaprogramming to compute the determina
 };
 
 template<> struct dt<1> {   // template specialization to stop the recursion
-    static double det(const mat<1,1>& src) {
+    static constexpr double det(const mat<1,1>& src) {
         return src[0][0];
     }
 };
+
+template<> struct dt<2> {   // closed forms for the sizes used by the renderer, no sub-matrices are built
+    static constexpr double det(const mat<2,2>& src) {
+        return src[0][0]*src[1][1] - src[0][1]*src[1][0];
+    }
+};
+
+template<> struct dt<3> {
+    static constexpr double det(const mat<3,3>& src) {
+        return src[0]*cross(src[1], src[2]);
+    }
+};
+
+template<> struct dt<4> {
+    static constexpr double det(const mat<4,4>& src) {
+        const vec4 &a = src[0], &b = src[1], &c = src[2], &d = src[3];
+        return (a.x*b.y - b.x*a.y)*(c.z*d.w - d.z*c.w) - (a.x*b.z - b.x*a.z)*(c.y*d.w - d.y*c.w)
+             + (a.x*b.w - b.x*a.w)*(c.y*d.z - d.y*c.z) + (a.y*b.z - b.y*a.z)*(c.x*d.w - d.x*c.w)
+             - (a.y*b.w - b.y*a.w)*(c.x*d.z - d.x*c.z) + (a.z*b.w - b.z*a.w)*(c.x*d.y - d.x*c.y);
+    }
+};
+
+// 4x4 kernels for the per-vertex and per-pixel transforms; they take precedence over the generic templates above,
+// which stay reachable with explicit template arguments, e.g. operator*<4,4>(m, v)
+static_assert(sizeof(vec4)==4*sizeof(double), "the SIMD kernels load vec4 as four packed doubles");
+
+constexpr vec4 operator*(const mat<4,4>& lhs, const vec4& rhs) {
+    if (std::is_constant_evaluated())
+        return {lhs[0]*rhs, lhs[1]*rhs, lhs[2]*rhs, lhs[3]*rhs};
+#if defined(__AVX__)
+    __m256d v  = _mm256_loadu_pd(&rhs.x);
+    __m256d p0 = _mm256_mul_pd(_mm256_loadu_pd(&lhs[0].x), v);
+    __m256d p1 = _mm256_mul_pd(_mm256_loadu_pd(&lhs[1].x), v);
+    __m256d p2 = _mm256_mul_pd(_mm256_loadu_pd(&lhs[2].x), v);
+    __m256d p3 = _mm256_mul_pd(_mm256_loadu_pd(&lhs[3].x), v);
+    __m256d h01 = _mm256_hadd_pd(p0, p1); // {p0.xy, p1.xy, p0.zw, p1.zw}
+    __m256d h23 = _mm256_hadd_pd(p2, p3);
+    __m256d sum = _mm256_add_pd(_mm256_permute2f128_pd(h01, h23, 0x21), _mm256_blend_pd(h01, h23, 0b1100));
+    vec4 ret;
+    _mm256_storeu_pd(&ret.x, sum);
+    return ret;
+#elif defined(__SSE2__)
+    __m128d vxy = _mm_loadu_pd(&rhs.x), vzw = _mm_loadu_pd(&rhs.z);
+    auto dot2 = [&](const vec4 &r0, const vec4 &r1) { // dot products of two rows with rhs
+        __m128d p0 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&r0.x), vxy), _mm_mul_pd(_mm_loadu_pd(&r0.z), vzw));
+        __m128d p1 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&r1.x), vxy), _mm_mul_pd(_mm_loadu_pd(&r1.z), vzw));
+        return _mm_add_pd(_mm_unpacklo_pd(p0, p1), _mm_unpackhi_pd(p0, p1));
+    };
+    vec4 ret;
+    _mm_storeu_pd(&ret.x, dot2(lhs[0], lhs[1]));
+    _mm_storeu_pd(&ret.z, dot2(lhs[2], lhs[3]));
+    return ret;
+#else
+    return {lhs[0]*rhs, lhs[1]*rhs, lhs[2]*rhs, lhs[3]*rhs};
+#endif
+}
+
+constexpr mat<4,4> operator*(const mat<4,4>& lhs, const mat<4,4>& rhs) {
+    if (std::is_constant_evaluated())
+        return operator*<4,4,4>(lhs, rhs);
+#if defined(__AVX__)
+    mat<4,4> result;
+    for (int i=4; i--; ) {
+        __m256d acc = _mm256_mul_pd(_mm256_set1_pd(lhs[i].x), _mm256_loadu_pd(&rhs[0].x));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_set1_pd(lhs[i].y), _mm256_loadu_pd(&rhs[1].x)));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_set1_pd(lhs[i].z), _mm256_loadu_pd(&rhs[2].x)));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(_mm256_set1_pd(lhs[i].w), _mm256_loadu_pd(&rhs[3].x)));
+        _mm256_storeu_pd(&result[i].x, acc);
+    }
+    return result;
+#elif defined(__SSE2__)
+    mat<4,4> result;
+    for (int i=4; i--; ) {
+        __m128d xy = _mm_setzero_pd(), zw = _mm_setzero_pd();
+        for (int k=4; k--; ) {
+            __m128d s = _mm_set1_pd(lhs[i][k]);
+            xy = _mm_add_pd(xy, _mm_mul_pd(s, _mm_loadu_pd(&rhs[k].x)));
+            zw = _mm_add_pd(zw, _mm_mul_pd(s, _mm_loadu_pd(&rhs[k].z)));
+        }
+        _mm_storeu_pd(&result[i].x, xy);
+        _mm_storeu_pd(&result[i].z, zw);
+    }
+    return result;
+#else
+    return operator*<4,4,4>(lhs, rhs);
+#endif
+}
@@ -0,0 +1,117 @@
+// Micro-benchmark of the closed-form inverses/determinants and the 4x4 SIMD kernels of linalg.h
+// against the generic templates they replace on the hot paths.
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "linalg.h"
+
+// the recursive cofactor expansion linalg.h used for every size before the closed forms
+template<int n> double det_generic(const mat<n,n>& m);
+
+template<int n> double cofactor_generic(const mat<n,n>& m, const int row, const int col) {
+    mat<n-1,n-1> submatrix;
+    for (int i=n-1; i--; )
+        for (int j=n-1; j--; submatrix[i][j]=m[i+int(i>=row)][j+int(j>=col)]);
+    return det_generic(submatrix) * ((row+col)%2 ? -1 : 1);
+}
+
+template<int n> double det_generic(const mat<n,n>& m) {
+    if constexpr (n==1) {
+        return m[0][0];
+    } else {
+        double ret = 0;
+        for (int i=n; i--; ret += m[0][i] * cofactor_generic(m, 0, i));
+        return ret;
+    }
+}
+
+template<int n> mat<n,n> invert_transpose_generic(const mat<n,n>& m) {
+    mat<n,n> adjugate_transpose;
+    for (int i=n; i--; )
+        for (int j=n; j--; adjugate_transpose[i][j]=cofactor_generic(m, i, j));
+    return adjugate_transpose/(adjugate_transpose[0]*m[0]);
+}
+
+// the closed forms must stay usable in constant expressions
+static_assert(mat<2,2>{{{2, 1}, {1, 3}}}.det() == 5);
+static_assert(mat<3,3>{{{2, 0, 0}, {0, 3, 0}, {0, 0, 4}}}.det() == 24);
+static_assert(mat<4,4>{{{2, 0, 0, 1}, {0, 4, 0, 2}, {0, 0, 8, 3}, {0, 0, 0, 1}}}.invert()[0][3] == -.5);
+static_assert((mat<4,4>{{{1, 0, 0, 1}, {0, 1, 0, 2}, {0, 0, 1, 3}, {0, 0, 0, 1}}} * vec4{1, 1, 1, 1}).z == 4);
+
+volatile double sink = 0; // keeps the optimizer from dropping the benchmarked work
+
+template<typename F> double bench(const char *name, const int iterations, F&& f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i=0; i<iterations; i++) f(i);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+    std::cout << "  " << name << ": " << ns << " ns/op" << std::endl;
+    return ns;
+}
+
+// the 4x4 products are consumed whole, reading one entry would let the compiler drop most of the generic version
+double total(const vec4 &v) { return v.x + v.y + v.z + v.w; }
+double total(const mat<4,4> &m) { return total(m[0]) + total(m[1]) + total(m[2]) + total(m[3]); }
+
+template<int n> double max_error(const mat<n,n>& a, const mat<n,n>& b) {
+    double err = 0;
+    for (int i=n; i--; )
+        for (int j=n; j--; err = std::max(err, std::abs(a[i][j]-b[i][j])));
+    return err;
+}
+
+int main(int argc, char** argv) {
+    constexpr int nmatrices = 1024;
+    const int iterations = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    std::vector<mat<3,3>> m3(nmatrices);
+    std::vector<mat<4,4>> m4(nmatrices), affine(nmatrices);
+    std::vector<vec4> v4(nmatrices);
+    for (int k=0; k<nmatrices; k++) {
+        for (int i=3; i--; )
+            for (int j=3; j--; m3[k][i][j] = dist(gen));
+        for (int i=4; i--; v4[k][i] = dist(gen))
+            for (int j=4; j--; m4[k][i][j] = dist(gen));
+        affine[k] = m4[k];
+        affine[k][3] = {0, 0, 0, 1};
+    }
+
+    double err = 0;
+    for (int k=0; k<nmatrices; k++) {
+        err = std::max(err, std::abs(m3[k].det() - det_generic(m3[k])));
+        err = std::max(err, std::abs(m4[k].det() - det_generic(m4[k])));
+        err = std::max(err, max_error(m3[k].invert_transpose(), invert_transpose_generic(m3[k])) * std::abs(m3[k].det()));
+        err = std::max(err, max_error(m4[k].invert_transpose(), invert_transpose_generic(m4[k])) * std::abs(m4[k].det()));
+        err = std::max(err, max_error(affine[k].invert_affine(), affine[k].invert()) * std::abs(affine[k].det()));
+        err = std::max(err, norm(m4[k]*v4[k] - operator*<4,4>(m4[k], v4[k])));
+        err = std::max(err, max_error(m4[k]*affine[k], operator*<4,4,4>(m4[k], affine[k])));
+    }
+    std::cout << "max deviation from the generic templates: " << err << std::endl;
+
+    const int mask = nmatrices - 1;
+    auto compare = [iterations](const char *title, auto generic, const char *name, auto fast) {
+        std::cout << title << std::endl;
+        double ns_generic = bench("generic", iterations, generic);
+        double ns_fast    = bench(name, iterations, fast);
+        std::cout << "  speedup: x" << ns_generic / ns_fast << std::endl;
+    };
+
+    compare("det 3x3",              [&](int i) { sink = sink + det_generic(m3[i & mask]); },
+            "closed-form",          [&](int i) { sink = sink + m3[i & mask].det(); });
+    compare("det 4x4",              [&](int i) { sink = sink + det_generic(m4[i & mask]); },
+            "closed-form",          [&](int i) { sink = sink + m4[i & mask].det(); });
+    compare("invert_transpose 3x3", [&](int i) { sink = sink + invert_transpose_generic(m3[i & mask])[1][2]; },
+            "closed-form",          [&](int i) { sink = sink + m3[i & mask].invert_transpose()[1][2]; });
+    compare("invert 4x4",           [&](int i) { sink = sink + invert_transpose_generic(m4[i & mask]).transpose()[1][2]; },
+            "closed-form",          [&](int i) { sink = sink + m4[i & mask].invert()[1][2]; });
+    compare("invert 4x4 affine",    [&](int i) { sink = sink + invert_transpose_generic(affine[i & mask]).transpose()[1][2]; },
+            "affine",               [&](int i) { sink = sink + affine[i & mask].invert_affine()[1][2]; });
+    compare("mat<4,4>*vec4",        [&](int i) { sink = sink + total(operator*<4,4>(m4[i & mask], v4[i & mask])); },
+            "simd",                 [&](int i) { sink = sink + total(m4[i & mask] * v4[i & mask]); });
+    compare("mat<4,4>*mat<4,4>",    [&](int i) { sink = sink + total(operator*<4,4,4>(m4[i & mask], m4[(i+1) & mask])); },
+            "simd",                 [&](int i) { sink = sink + total(m4[i & mask] * m4[(i+1) & mask]); });
+
+    return err < 1e-9 ? 0 : 1;
+}
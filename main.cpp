@@ -1,34 +1,70 @@
 #include <random>
-#include <cmath>
-#include <algorithm>
 #include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
 #include "tgaimage.h"
 #include "model.h"
+#include "meshstream.h"
+#include "profile.h"
 #include "linalg.h"
 #include "our_gl.h"
 
-extern mat<4,4> Viewport, ModelView, Perspective;
-extern std::vector<double> zbuffer;
-
 struct Blankshader : IShader {
-    const Model &model;
-
-    Blankshader(const Model &m) : model(m) {}
-
-    virtual vec4 vertex(const int face, const int vert) {
-        vec4 gl_Position = ModelView * model.vert(face, vert);
-        return Perspective * gl_Position;
-    }
-
-    virtual std::pair<bool, TGAColor> fragment(const vec3 bar) const {
+    virtual std::pair<bool, TGAColor> fragment(const int, const vec3 bar) const {
         TGAColor gl_FragColor = {255, 255, 255, 255};
         return {false, gl_FragColor};
     }
 };
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        std::cout << "no add file" << std::endl;
+    std::size_t stream_budget = 0; // bytes, 0 means the whole model is loaded in memory
+    int msaa = 1;
+    bool convert = false;
+    bool profile = false, heatmaps = false;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-s" && i + 1 < argc)
+            stream_budget = std::strtoull(argv[++i], nullptr, 10) << 20;
+        else if (arg == "-m" && i + 1 < argc)
+            msaa = std::atoi(argv[++i]);
+        else if (arg == "-c")
+            convert = true;
+        else if (arg == "-p")
+            profile = true;
+        else if (arg == "-H")
+            heatmaps = true;
+        else
+            files.push_back(arg);
+    }
+    if (files.empty()) {
+        std::cout << "usage: " << argv[0] << " [-s budget_MiB] [-m samples] [-c] [-p] [-H] model.obj|model.soup..." << std::endl;
+        std::cout << "  -s  stream the meshes from disk in chunks fitting the memory budget" << std::endl;
+        std::cout << "  -m  multisample anti-aliasing with 2, 4 or 8 samples per pixel" << std::endl;
+        std::cout << "  -c  convert each OBJ to a .soup file for streaming, then exit" << std::endl;
+        std::cout << "  -p  print the stage counters and write a Chrome trace to trace.json" << std::endl;
+        std::cout << "  -H  write overdraw.tga and shading_cost.tga heat maps" << std::endl;
+        return 0;
+    }
+
+    if (msaa != 1 && msaa != 2 && msaa != 4 && msaa != 8) {
+        std::cerr << "MSAA sample count must be 1, 2, 4 or 8" << std::endl;
+        return 1;
+    }
+
+#ifndef TINYRENDERER_PROFILE
+    if (profile || heatmaps) std::cerr << "built without profiling, -p and -H are ignored" << std::endl;
+#endif
+    Profiler::enabled = profile;
+    PROFILE_THREAD("main");
+
+    if (convert) {
+        for (const std::string &obj : files) {
+            size_t dot = obj.find_last_of(".");
+            std::string soup = (dot == std::string::npos ? obj : obj.substr(0, dot)) + ".soup";
+            if (!write_soup(obj, soup, stream_budget ? stream_budget : std::size_t(64) << 20)) return 1;
+        }
         return 0;
     }
 
@@ -41,52 +77,53 @@ int main(int argc, char** argv) {
     lookat(eye, center, up);
     init_perspective(norm(eye - center));
     init_viewport(width / 16, height / 16, width * 7 / 8, height * 7 / 8);
-    init_zbuffer(width, height);
+    init_zbuffer(width, height, msaa);
     TGAImage framebuffer(width, height, TGAImage::RGB, {177, 195, 209, 255});
+#ifdef TINYRENDERER_PROFILE
+    if (heatmaps) Profiler::init_heatmaps(width, height);
+#endif
 
-    for (int m = 1; m < argc; m++) {
-        Model model(argv[m]);
-        Blankshader shader(model);
-        for (int f = 0; f < model.nfaces(); f++) {
-            Triangle clip = {shader.vertex(f, 0),
-                            shader.vertex(f, 1),
-                            shader.vertex(f, 2)};
-            rasterize(clip, shader, framebuffer);            
+    Blankshader shader;
+    std::vector<Triangle> clips;
+    if (stream_budget) {
+        for (const std::string &file : files) {
+            PROFILE_SCOPE("model", file);
+            MeshStream stream(file, stream_budget, sizeof(Triangle) + raster_bytes_per_triangle()); // clips and rasterizer scratch
+            std::vector<vec4> chunk;
+            while (stream.next(chunk)) { // the next chunk is being read while this one is rasterized
+                {
+                    PROFILE_SCOPE("vertex");
+                    vertex_stage(shader, 0, chunk.size() / 3, clips, [&](const int f, const int v) { return chunk[f * 3 + v]; });
+                }
+                rasterize(clips, shader, framebuffer);
+            }
         }
-    }
-
-    constexpr double ao_radius = .1;
-    constexpr int nsamples = 128;
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<double> dist(-ao_radius, ao_radius);
-    auto smoothstep = [](double edge0, double edge1, double x) {
-        double  t = std::clamp((x - edge0) / (edge1 - edge0), 0., 1.);
-        return t * t * (3 - 2 * t);
-    };
-
-#pragma omp parallel for
-    for (int x = 0; x < width; x++) {
-        for (int y = 0; y < height; y++) {
-            double z = zbuffer[x + y * width];
-            if (z <- 100) continue;
-            vec4 fragment = Viewport.invert() * vec4{static_cast<double>(x), static_cast<double>(y), static_cast<double>(z), 1.};
-            double vote = 0;
-            double voters = 0;
-            for (int i = 0; i < nsamples; i++) {
-                vec4 p = Viewport * (fragment + vec4{dist(gen), dist(gen), dist(gen), 0.});
-                if (p.x < 0 || p.x >= width || p.y < 0 || p.y >= height) continue;
-                double d = zbuffer[int(p.x) + int(p.y) * width];
-                if (z + 5 * ao_radius < d) continue;
-                voters++;
-                vote += d > p.z;
+    } else {
+        for (const std::string &file : files) { // one model in memory at a time
+            PROFILE_SCOPE("model", file);
+            Model model(file);
+            for (int first = 0; first < model.nfaces(); first += raster_batch) { // the clip coordinates are kept for one batch only
+                {
+                    PROFILE_SCOPE("vertex");
+                    vertex_stage(shader, first, std::min(raster_batch, model.nfaces() - first), clips,
+                                 [&](const int f, const int v) { return model.vert(f, v); });
+                }
+                rasterize(clips, shader, framebuffer, first);
             }
-            double ssao = smoothstep(0, 1, 1 - vote / voters * .4);
-            TGAColor c = framebuffer.get(x, y);
-            framebuffer.set(x, y, {static_cast<uint8_t>(c[0] * ssao), static_cast<uint8_t>(c[1] * ssao), static_cast<uint8_t>(c[2] * ssao), c[3]});
         }
     }
+    resolve_msaa(framebuffer);
+
+    ambient_occlusion(framebuffer, .1, 128, std::random_device{}());
     framebuffer.write_tga_file("framebuffer.tga");
 
+#ifdef TINYRENDERER_PROFILE
+    if (heatmaps) Profiler::write_heatmaps("overdraw.tga", "shading_cost.tga");
+    if (profile) {
+        Profiler::print_counters();
+        Profiler::write_trace("trace.json");
+    }
+#endif
+
     return 0;
 }       
\ No newline at end of file
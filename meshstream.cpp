@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include "meshstream.h"
+#include "profile.h"
+
+constexpr char soup_magic[8] = {'T','R','S','O','U','P','1','\n'};
+constexpr std::size_t soup_block = 4096; // faces converted between the file and the chunks at a time
+
+MeshStream::MeshStream(const std::string& filepath, const std::size_t budget, const std::size_t consumer_bytes_per_face) {
+    const std::size_t staging_bytes = soup_block * 9 * sizeof(double);
+    const std::size_t face_bytes = 3 * 3 * sizeof(vec4) + consumer_bytes_per_face; // consumer chunk, ready chunk, prefetched chunk
+    max_faces = std::max<std::size_t>(1, (budget > staging_bytes ? budget - staging_bytes : 0) / face_bytes);
+
+    file.open(filepath, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open file " << filepath << std::endl;
+        exhausted = true;
+        return;
+    }
+    char magic[sizeof(soup_magic)] = {};
+    file.read(magic, sizeof(magic));
+    if (file.good() && !std::memcmp(magic, soup_magic, sizeof(magic))) {
+        binary = true;
+        file.read(reinterpret_cast<char *>(&soup_left), sizeof(soup_left));
+        if (!file.good()) {
+            std::cerr << "Error: truncated soup header in " << filepath << std::endl;
+            file.close();
+            exhausted = true;
+            return;
+        }
+    } else {
+        file.clear();
+        file.seekg(0);
+    }
+    opened = true;
+    worker = std::thread(&MeshStream::prefetch, this);
+}
+
+MeshStream::~MeshStream() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_all();
+    if (worker.joinable()) worker.join();
+}
+
+bool MeshStream::is_open() const { return opened; }
+
+std::size_t MeshStream::chunk_faces() const { return max_faces; }
+
+bool MeshStream::next(std::vector<vec4>& chunk) {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [this] { return has_ready || exhausted; });
+    if (!has_ready) return false;
+    std::swap(chunk, ready);
+    has_ready = false;
+    lock.unlock();
+    cv.notify_all();
+    return true;
+}
+
+void MeshStream::prefetch() {
+    PROFILE_THREAD("mesh prefetch");
+    std::vector<vec4> chunk;
+    while (true) {
+        bool more = read_chunk(chunk);
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!more) {
+            exhausted = true;
+            lock.unlock();
+            cv.notify_all();
+            return;
+        }
+        cv.wait(lock, [this] { return !has_ready || stop; });
+        if (stop) return;
+        std::swap(chunk, ready); // hands the buffer over and recycles the one the consumer returned
+        has_ready = true;
+        lock.unlock();
+        cv.notify_all();
+    }
+}
+
+bool MeshStream::read_chunk(std::vector<vec4>& chunk) {
+    chunk.clear();
+    if (!file.is_open()) return false;
+    chunk.reserve(max_faces * 3);
+    return binary ? read_soup_chunk(chunk) : read_obj_chunk(chunk);
+}
+
+bool MeshStream::read_soup_chunk(std::vector<vec4>& chunk) {
+    std::uint64_t nfaces = std::min<std::uint64_t>(soup_left, max_faces);
+    if (!nfaces) return false;
+    staging.resize(std::min<std::size_t>(nfaces, soup_block) * 9);
+    for (std::uint64_t done = 0; done < nfaces; ) {
+        std::size_t n = std::min<std::uint64_t>(nfaces - done, soup_block) * 9;
+        file.read(reinterpret_cast<char *>(staging.data()), n * sizeof(double));
+        if (!file.good()) {
+            std::cerr << "Error: truncated soup data" << std::endl;
+            soup_left = 0;
+            return false;
+        }
+        for (std::size_t i = 0; i < n; i += 3)
+            chunk.push_back({staging[i], staging[i + 1], staging[i + 2], 1.});
+        done += n / 9;
+    }
+    soup_left -= nfaces;
+    return true;
+}
+
+bool MeshStream::read_obj_chunk(std::vector<vec4>& chunk) {
+    std::string line;
+    while (chunk.size() < max_faces * 3 && std::getline(file, line)) {
+        std::stringstream ss(line);
+        std::string line_type;
+        ss >> line_type;
+
+        if (!line_type.compare("v")) {
+            double x, y, z;
+            ss >> x >> y >> z;
+            positions.push_back({x, y, z});
+        }
+
+        else if (!line_type.compare("f")) {
+            std::string token;
+            vec4 face[3] = {};
+            int nverts = 0;
+            for (; nverts < 3 && ss >> token; nverts++) {
+                int idx = std::atoi(token.c_str()); // the position index is the first '/'-separated field
+                idx = idx > 0 ? idx - 1 : 0;
+                if (idx >= static_cast<int>(positions.size())) idx = 0;
+                vec3 p = positions.empty() ? vec3{} : positions[idx];
+                face[nverts] = {p.x, p.y, p.z, 1.};
+            }
+            if (nverts < 3) continue; // a truncated face line, there is no triangle to draw
+            for (int i = 0; i < 3; i++) chunk.push_back(face[i]);
+        }
+    }
+    return !chunk.empty();
+}
+
+bool write_soup(const std::string& objpath, const std::string& souppath, const std::size_t budget) {
+    MeshStream stream(objpath, budget);
+    if (!stream.is_open()) return false;
+    std::ofstream out(souppath, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << souppath << "\n";
+        return false;
+    }
+    std::uint64_t nfaces = 0;
+    out.write(soup_magic, sizeof(soup_magic));
+    out.write(reinterpret_cast<const char *>(&nfaces), sizeof(nfaces)); // patched once the face count is known
+
+    std::vector<vec4> chunk;
+    std::vector<double> raw;
+    while (stream.next(chunk)) {
+        for (std::size_t first = 0; first < chunk.size(); first += soup_block * 3) {
+            raw.clear();
+            for (std::size_t i = first; i < std::min(chunk.size(), first + soup_block * 3); i++)
+                raw.insert(raw.end(), {chunk[i].x, chunk[i].y, chunk[i].z});
+            out.write(reinterpret_cast<const char *>(raw.data()), raw.size() * sizeof(double));
+        }
+        nfaces += chunk.size() / 3;
+    }
+    out.seekp(sizeof(soup_magic));
+    out.write(reinterpret_cast<const char *>(&nfaces), sizeof(nfaces));
+    if (!out.good()) {
+        std::cerr << "can't dump the soup file\n";
+        return false;
+    }
+    return true;
+}
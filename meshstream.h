@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "linalg.h"
+
+// Streams the triangles of a mesh from disk in bounded-size chunks, so that meshes larger than RAM can be rendered.
+// Two input forms are accepted:
+//   - text OBJ: faces are streamed, only the vertex positions stay resident (OBJ faces may refer to any earlier vertex);
+//   - binary triangle soup (see write_soup()): every chunk is self-contained, nothing but the chunks stays resident.
+// The next chunk is prefetched on a background thread while the caller works on the current one.
+// The chunk size is chosen so that the three chunk buffers in flight (the caller's, the ready one and the one being read),
+// plus consumer_bytes_per_face for every face the caller holds derived data for, fit in the budget.
+// For OBJ input the resident vertex positions come on top of it.
+class MeshStream {
+public:
+    MeshStream(const std::string& filepath, const std::size_t budget, const std::size_t consumer_bytes_per_face = 0);
+    ~MeshStream();
+    MeshStream(const MeshStream&) = delete;
+    MeshStream& operator=(const MeshStream&) = delete;
+
+    bool is_open() const;
+
+    // blocks until the prefetched chunk is ready, then hands it over; returns false once the mesh is exhausted
+    // the chunk holds 3 object-space positions per face
+    bool next(std::vector<vec4>& chunk);
+
+    std::size_t chunk_faces() const;
+
+private:
+    bool read_chunk(std::vector<vec4>& chunk);
+    bool read_obj_chunk(std::vector<vec4>& chunk);
+    bool read_soup_chunk(std::vector<vec4>& chunk);
+    void prefetch();
+
+    std::ifstream file = {}; // owned by the prefetch thread once it is started
+    bool opened = false;
+    bool binary = false;
+    std::uint64_t soup_left = 0;
+    std::size_t max_faces = 1;
+    std::vector<vec3> positions = {};
+    std::vector<double> staging = {}; // soup records read from disk, one block at a time
+
+    std::thread worker = {};
+    std::mutex mtx = {};
+    std::condition_variable cv = {};
+    std::vector<vec4> ready = {};
+    bool has_ready = false;
+    bool exhausted = false;
+    bool stop = false;
+};
+
+// converts a text OBJ into the binary triangle soup read by MeshStream, streaming it through a bounded buffer
+bool write_soup(const std::string& objpath, const std::string& souppath, const std::size_t budget);
@@ -1,35 +1,28 @@
 #include "model.h"
 #include "tgaimage.h"
+#include "scheduler.h"
+#include "profile.h"
+#include <algorithm>
 #include <cstddef>
 #include <fstream>
 #include <sstream>
 #include <string>
 #include <iostream>
 
-Model::Model () {
-
-}
-
-Model::Model (const std::string& filepath) {
-    load(filepath);    
-}
-
-bool Model::load(const std::string& filepath) {
-    vertices_.clear();
-    normals_.clear();
-    tex_.clear();
-    faces_vrt.clear();
-    faces_nrm.clear();
-    faces_tex.clear();
-
-    std::ifstream file(filepath);
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open file " << filepath <<std::endl;
-        return false;
-    }
+struct ObjChunk { // what one slice of the OBJ text contributes, in file order
+    std::vector<vec4> vertices, normals;
+    std::vector<vec2> tex;
+    std::vector<int> faces_vrt, faces_nrm, faces_tex;
+};
 
+// OBJ indices are absolute, so the slices can be parsed independently and concatenated;
+// [begin, end) points into the file contents, only the current line is copied
+static void parse_obj(const char *begin, const char *end, ObjChunk &out) {
+    PROFILE_SCOPE("parse obj slice");
     std::string line;
-    while (std::getline(file, line)) {
+    for (const char *eol; begin < end; begin = eol + 1) {
+        eol = std::find(begin, end, '\n');
+        line.assign(begin, eol);
         std::stringstream ss(line);
         std::string line_type;
         ss >> line_type;
@@ -37,19 +30,19 @@ bool Model::load(const std::string& filepath) {
         if (!line_type.compare("v")) {
             double x, y, z;
             ss >> x >> y >> z;
-            vertices_.push_back({x, y, z, 1.});
+            out.vertices.push_back({x, y, z, 1.});
         }
 
         else if (!line_type.compare("vn")) {
             double x, y, z;
             ss >> x >> y >> z;
-            normals_.push_back({x, y, z, 1.});
+            out.normals.push_back({x, y, z, 1.});
         }
 
         else if (!line_type.compare("vt")) {
             double u, v;
             ss >> u >> v;
-            tex_.push_back({u, 1. - v});
+            out.tex.push_back({u, 1. - v});
         }
 
         else if (!line_type.compare("f")) {
@@ -70,16 +63,128 @@ bool Model::load(const std::string& filepath) {
                 }
 
                 int ver_index = (current_indices.size() >= 1 && current_indices[0] > 0) ? current_indices[0] - 1 : 0;
-                faces_vrt.push_back(ver_index);
+                out.faces_vrt.push_back(ver_index);
 
                 int tex_index = (current_indices.size() >= 2 && current_indices[1] > 0) ? current_indices[1] - 1 : 0;
-                faces_tex.push_back(tex_index);
+                out.faces_tex.push_back(tex_index);
 
                 int nrm_index = (current_indices.size() >= 3 && current_indices[2] > 0) ? current_indices[2] - 1 : 0;
-                faces_nrm.push_back(nrm_index);
+                out.faces_nrm.push_back(nrm_index);
             }
         }
     }
+}
+
+// calls batch(begin, end) on consecutive ranges of whole lines of the file, of about batch_bytes each,
+// through a single buffer reused from one batch to the next
+template<typename F> static void read_batches(std::ifstream &file, const size_t batch_bytes, F&& batch) {
+    std::string text;
+    size_t kept = 0; // start of a line that did not fit in the previous batch
+    while (true) {
+        text.resize(kept + batch_bytes);
+        file.read(text.data() + kept, batch_bytes);
+        const size_t size = kept + file.gcount();
+        const bool last = !file;
+        size_t end = size;
+        if (!last) {
+            end = text.rfind('\n', size - 1) + 1; // npos wraps around to 0
+            if (!end) { // a single line longer than the batch, keep reading it
+                kept = size;
+                continue;
+            }
+        }
+        batch(text.data(), text.data() + end);
+        if (last) return;
+        kept = size - end;
+        std::copy(text.begin() + end, text.begin() + size, text.begin());
+    }
+}
+
+enum ObjLine { OBJ_V, OBJ_VN, OBJ_VT, OBJ_F, OBJ_NLINES };
+
+// adds the number of v, vn, vt and f lines in [begin, end) to counts, an upper bound of what parse_obj() produces
+static void count_obj(const char *begin, const char *end, size_t counts[OBJ_NLINES]) {
+    for (const char *eol; begin < end; begin = eol + 1) {
+        eol = std::find(begin, end, '\n');
+        if (eol - begin < 2) continue;
+        const bool blank = begin[1] == ' ' || begin[1] == '\t';
+        if (begin[0] == 'f' && blank) counts[OBJ_F]++;
+        else if (begin[0] == 'v') counts[begin[1] == 'n' ? OBJ_VN : begin[1] == 't' ? OBJ_VT : OBJ_V] += blank || begin[1] == 'n' || begin[1] == 't';
+    }
+}
+
+Model::Model () {
+
+}
+
+Model::Model (const std::string& filepath) {
+    load(filepath);    
+}
+
+bool Model::load(const std::string& filepath) {
+    PROFILE_SCOPE("Model::load", filepath);
+    vertices_.clear();
+    normals_.clear();
+    tex_.clear();
+    faces_vrt.clear();
+    faces_nrm.clear();
+    faces_tex.clear();
+
+    std::ifstream file(filepath);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open file " << filepath <<std::endl;
+        return false;
+    }
+
+    // two passes over the file in bounded batches of whole lines: the first one counts the elements, so that
+    // the arrays are allocated once at their final size; the second one cuts each batch into slices parsed in parallel,
+    // the first slice straight into the arrays, the others appended in order. Only one batch of text and its slices
+    // exist next to the model; on a single thread there is a single slice and nothing is copied
+    constexpr size_t slice_bytes = 1 << 18;
+    const size_t nslices = Scheduler::instance().nthreads();
+    size_t counts[OBJ_NLINES] = {};
+    read_batches(file, slice_bytes, [&counts](const char *begin, const char *end) { count_obj(begin, end, counts); });
+    file.clear();
+    file.seekg(0);
+
+    ObjChunk parsed;
+    parsed.vertices.reserve(counts[OBJ_V]);
+    parsed.normals.reserve(counts[OBJ_VN]);
+    parsed.tex.reserve(counts[OBJ_VT]);
+    for (auto *faces : {&parsed.faces_vrt, &parsed.faces_nrm, &parsed.faces_tex}) faces->reserve(3 * counts[OBJ_F]);
+
+    std::vector<ObjChunk> rest(nslices - 1);
+    read_batches(file, nslices * slice_bytes, [&](const char *begin, const char *end) {
+        std::vector<const char *> cuts = {begin};
+        for (size_t i = 1; i < nslices; i++) { // cut right after a newline so that no line is split
+            const char *cut = std::find(std::max(cuts.back(), begin + (end - begin) * i / nslices), end, '\n');
+            if (cut + 1 >= end) break;
+            cuts.push_back(cut + 1);
+        }
+        cuts.push_back(end);
+        parallel_for(0, cuts.size() - 1, 1, [&](const int i) {
+            parse_obj(cuts[i], cuts[i + 1], i ? rest[i - 1] : parsed);
+        });
+        for (size_t i = 0; i + 2 < cuts.size(); i++) {
+            ObjChunk &chunk = rest[i];
+            parsed.vertices.insert(parsed.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+            parsed.normals.insert(parsed.normals.end(), chunk.normals.begin(), chunk.normals.end());
+            parsed.tex.insert(parsed.tex.end(), chunk.tex.begin(), chunk.tex.end());
+            parsed.faces_vrt.insert(parsed.faces_vrt.end(), chunk.faces_vrt.begin(), chunk.faces_vrt.end());
+            parsed.faces_nrm.insert(parsed.faces_nrm.end(), chunk.faces_nrm.begin(), chunk.faces_nrm.end());
+            parsed.faces_tex.insert(parsed.faces_tex.end(), chunk.faces_tex.begin(), chunk.faces_tex.end());
+            for (auto *v : {&chunk.vertices, &chunk.normals}) v->clear(); // the capacity is reused by the next batch
+            chunk.tex.clear();
+            for (auto *v : {&chunk.faces_vrt, &chunk.faces_nrm, &chunk.faces_tex}) v->clear();
+        }
+    });
+
+    vertices_.swap(parsed.vertices);
+    normals_.swap(parsed.normals);
+    tex_.swap(parsed.tex);
+    faces_vrt.swap(parsed.faces_vrt);
+    faces_nrm.swap(parsed.faces_nrm);
+    faces_tex.swap(parsed.faces_tex);
     // std::cout << "Loaded " << nverts() << " vertices and " << nfaces() << " faces." << std::endl;
 
     auto load_texture = [&filepath](const std::string suffix, TGAImage &img) {
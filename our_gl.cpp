@@ -1,9 +1,57 @@
 #include <algorithm>
+#include <cstdint>
+#include <random>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include "our_gl.h"
+#include "scheduler.h"
+#include "profile.h"
 
 mat<4, 4> ModelView, Viewport, Perspective;
 std::vector<double> zbuffer;
 
+// MSAA state: depth is kept per sample, colour only for the pixels where the samples disagree,
+// the other pixels keep their single colour in the framebuffer until resolve_msaa()
+int msaa_samples = 1;
+std::vector<float> sample_depth;          // width*height*msaa_samples
+std::vector<std::uint8_t> pixel_split;    // width*height
+std::vector<std::int32_t> pixel_slot;     // width*height, where the pixel's sample colours live in the pool, -1 if it never split
+
+// packed bgra sample colours, msaa_samples per slot, handed out on the first split of a pixel;
+// the block table is sized for every pixel upfront so that it never moves, the blocks are allocated on demand
+constexpr int pool_block = 4096; // slots per block
+std::vector<std::unique_ptr<std::uint32_t[]>> pool_blocks;
+int pool_slots = 0;
+std::mutex pool_mtx;
+
+constexpr vec2 sample_pattern2[2] = {{ .25,  .25}, {-.25, -.25}}; // the standard D3D patterns, relative to the pixel center
+constexpr vec2 sample_pattern4[4] = {{-.125, -.375}, { .375, -.125}, {-.375,  .125}, { .125,  .375}};
+constexpr vec2 sample_pattern8[8] = {{ .0625, -.1875}, {-.0625,  .1875}, { .3125,  .0625}, {-.1875, -.3125},
+                                     {-.3125,  .3125}, {-.4375, -.0625}, { .1875,  .4375}, { .4375, -.4375}};
+
+static const vec2 *sample_pattern() {
+    return msaa_samples == 2 ? sample_pattern2 : msaa_samples == 4 ? sample_pattern4 : sample_pattern8;
+}
+
+// a pixel is only ever touched by the thread rasterizing its tile, the pool itself is shared between the tiles
+static std::uint32_t *split_colors(const int idx) {
+    std::int32_t slot = pixel_slot[idx];
+    if (slot < 0) {
+        std::lock_guard<std::mutex> lock(pool_mtx);
+        slot = pixel_slot[idx] = pool_slots++;
+        if (!pool_blocks[slot / pool_block])
+            pool_blocks[slot / pool_block] = std::make_unique<std::uint32_t[]>(pool_block * msaa_samples);
+    }
+    return pool_blocks[slot / pool_block].get() + (slot % pool_block) * msaa_samples;
+}
+
+static std::uint32_t pack(const TGAColor &c) {
+    std::uint32_t ret;
+    std::memcpy(&ret, c.bgra, sizeof(ret));
+    return ret;
+}
+
 void lookat(const vec3 eye, const vec3 center, const vec3 up) {
     vec3 n = normalized(eye - center);
     vec3 l = normalized(cross(up, n));
@@ -32,41 +80,270 @@ void init_viewport(const int x, const int y, const int w, const int h) {
                 {0, 0, 0, 1}}};    
 }
 
-void init_zbuffer(const int width, const int height) {
+vec4 IShader::vertex(const vec4 v) const {
+    return Perspective * (ModelView * v);
+}
+
+void init_zbuffer(const int width, const int height, const int samples) {
+    assert(samples == 1 || samples == 2 || samples == 4 || samples == 8);
     zbuffer = std::vector(width * height, -1000.);
+    msaa_samples = samples;
+    pool_blocks.clear();
+    pool_slots = 0;
+    if (samples == 1) {
+        sample_depth.clear();
+        pixel_split.clear();
+        pixel_slot.clear();
+        return;
+    }
+    sample_depth = std::vector(width * height * samples, -1000.f);
+    pixel_split  = std::vector<std::uint8_t>(width * height, 0);
+    pixel_slot   = std::vector<std::int32_t>(width * height, -1);
+    pool_blocks.resize((width * height + pool_block - 1) / pool_block);
 }
 
-void rasterize(const Triangle &clip, const IShader &shader, TGAImage &framebuffer) {
-    vec4 ndc[3]  = { clip[0] / clip[0].w, clip[1] / clip[1].w, clip[2] / clip[2].w};
-    vec2 screen[3] = { (Viewport * ndc[0]).xy(), (Viewport * ndc[1]).xy(), (Viewport * ndc[2]).xy()};
+void resolve_msaa(TGAImage &framebuffer) {
+    if (msaa_samples == 1) return;
+    PROFILE_SCOPE("resolve_msaa");
+    const int S = msaa_samples;
+    parallel_for(0, framebuffer.height(), 8, [&](const int y) {
+        for (int x = 0; x < framebuffer.width(); x++) {
+            const int idx = x + y * framebuffer.width();
+            zbuffer[idx] = *std::max_element(sample_depth.begin() + idx * S, sample_depth.begin() + (idx + 1) * S);
+            if (!pixel_split[idx]) continue;
+            int sum[4] = {0, 0, 0, 0};
+            const std::uint32_t *samples = split_colors(idx);
+            for (int s = 0; s < S; s++) {
+                std::uint32_t c = samples[s];
+                for (int i = 0; i < 4; i++) sum[i] += (c >> (8 * i)) & 255;
+            }
+            TGAColor resolved;
+            for (int i = 0; i < 4; i++) resolved[i] = (sum[i] + S / 2) / S;
+            framebuffer.set(x, y, resolved);
+            pixel_split[idx] = 0;
+        }
+    });
+}
+
+void ambient_occlusion(TGAImage &framebuffer, const double radius, const int nsamples, const unsigned seed) {
+    PROFILE_SCOPE("ssao");
+    const int width = framebuffer.width(), height = framebuffer.height();
+    auto smoothstep = [](double edge0, double edge1, double x) {
+        double  t = std::clamp((x - edge0) / (edge1 - edge0), 0., 1.);
+        return t * t * (3 - 2 * t);
+    };
+
+    mat<4,4> viewport_inv = Viewport.invert_affine();
+    parallel_for(0, width, 4, [&](const int x) {
+        std::mt19937 gen(seed + x); // one generator per column, they cannot be shared between threads
+        std::uniform_real_distribution<double> dist(-radius, radius);
+        long samples = 0;
+        for (int y = 0; y < height; y++) {
+            double z = zbuffer[x + y * width];
+            if (z <- 100) continue;
+            vec4 fragment = viewport_inv * vec4{static_cast<double>(x), static_cast<double>(y), static_cast<double>(z), 1.};
+            samples += nsamples;
+            double vote = 0;
+            double voters = 0;
+            for (int i = 0; i < nsamples; i++) {
+                vec4 p = Viewport * (fragment + vec4{dist(gen), dist(gen), dist(gen), 0.});
+                if (p.x < 0 || p.x >= width || p.y < 0 || p.y >= height) continue;
+                double d = zbuffer[int(p.x) + int(p.y) * width];
+                if (z + 5 * radius < d) continue;
+                voters++;
+                vote += d > p.z;
+            }
+            double ssao = smoothstep(0, 1, 1 - vote / voters * .4);
+            TGAColor c = framebuffer.get(x, y);
+            framebuffer.set(x, y, {static_cast<uint8_t>(c[0] * ssao), static_cast<uint8_t>(c[1] * ssao), static_cast<uint8_t>(c[2] * ssao), c[3]});
+        }
+        PROFILE_COUNT(AO_SAMPLES, samples);
+    });
+}
+
+struct TriangleSetup { // everything the pixel loops need, computed once per triangle
+    vec4 ndc[3];
+    mat<3,3> bc_transform;
+    int bbminx, bbmaxx, bbminy, bbmaxy; // clamped to the framebuffer
+};
+
+static bool setup_triangle(const Triangle &clip, const TGAImage &framebuffer, TriangleSetup &t) {
+    for (int i = 0; i < 3; i++) t.ndc[i] = clip[i] / clip[i].w;
+    vec2 screen[3] = { (Viewport * t.ndc[0]).xy(), (Viewport * t.ndc[1]).xy(), (Viewport * t.ndc[2]).xy()};
 
     mat<3,3> ABC = {{{screen[0].x, screen[0].y, 1.},
                     {screen[1].x, screen[1].y, 1.},
                     {screen[2].x, screen[2].y, 1.}}};
-    if (ABC.det() < 1) return;
+    if (ABC.det() < 1) {
+        PROFILE_COUNT(TRIANGLES_CULLED, 1);
+        return false;
+    }
 
     auto x_bounds = std::minmax({screen[0].x, screen[1].x, screen[2].x});
     auto y_bounds = std::minmax({screen[0].y, screen[1].y, screen[2].y});
+    double margin = msaa_samples > 1 ? .5 : 0.; // the samples reach half a pixel around the pixel centers
 
-    int bbminx = static_cast<int>(x_bounds.first);
-    int bbmaxx = static_cast<int>(x_bounds.second);
+    t.bbminx = std::max<int>(static_cast<int>(x_bounds.first - margin), 0);
+    t.bbmaxx = std::min<int>(static_cast<int>(x_bounds.second + margin), framebuffer.width() - 1);
 
-    int bbminy = static_cast<int>(y_bounds.first);
-    int bbmaxy = static_cast<int>(y_bounds.second);
-    
-#pragma omp parallel for
-    for (int x = std::max<int>(bbminx, 0); x <= std::min<int>(bbmaxx, framebuffer.width() - 1); x++) {
-        for (int y = std::max<int>(bbminy, 0); y <= std::min<int>(bbmaxy, framebuffer.height() - 1); y++) {
-            vec3 bc_screen = ABC.invert_transpose() * vec3{static_cast<double>(x), static_cast<double>(y), 1.};
+    t.bbminy = std::max<int>(static_cast<int>(y_bounds.first - margin), 0);
+    t.bbmaxy = std::min<int>(static_cast<int>(y_bounds.second + margin), framebuffer.height() - 1);
+    if (t.bbminx > t.bbmaxx || t.bbminy > t.bbmaxy) {
+        PROFILE_COUNT(TRIANGLES_OFFSCREEN, 1);
+        return false;
+    }
+
+    t.bc_transform = ABC.invert_transpose();
+    return true;
+}
+
+// coverage and depth are evaluated at every sample, the shader runs once per pixel;
+// the barycentric coordinates are affine in screen space, so a sample is the pixel center plus a per-triangle offset
+static void rasterize_msaa(const Triangle &clip, const int face, const TriangleSetup &t, const int x0, const int x1, const int y0, const int y1,
+                           const IShader &shader, TGAImage &framebuffer) {
+    const int S = msaa_samples;
+    const vec2 *pattern = sample_pattern();
+    const std::uint32_t full = (1u << S) - 1;
+    const vec3 ndc_z = {t.ndc[0].z, t.ndc[1].z, t.ndc[2].z};
+    const vec3 ddx = {t.bc_transform[0][0], t.bc_transform[1][0], t.bc_transform[2][0]};
+    const vec3 ddy = {t.bc_transform[0][1], t.bc_transform[1][1], t.bc_transform[2][1]};
+    vec3 offset[8];
+    vec3 reach = {-1e10, -1e10, -1e10}; // largest offset per edge over the samples
+    for (int s = 0; s < S; s++) {
+        offset[s] = ddx * pattern[s].x + ddy * pattern[s].y;
+        for (int i = 0; i < 3; i++) reach[i] = std::max(reach[i], offset[s][i]);
+    }
+    long tested = 0, shaded = 0;
+
+    for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) {
+            vec3 bc_center = t.bc_transform * vec3{static_cast<double>(x), static_cast<double>(y), 1.};
+            if (bc_center.x + reach.x < 0 || bc_center.y + reach.y < 0 || bc_center.z + reach.z < 0) continue; // no sample inside
+            const int idx = x + y * framebuffer.width();
+            float *depth = sample_depth.data() + idx * S;
+            std::uint32_t passed = 0;
+            double z[8];
+            vec3 bc_shade = bc_center;
+            bool center_covered = bc_center.x >= 0 && bc_center.y >= 0 && bc_center.z >= 0;
+            for (int s = 0; s < S; s++) {
+                vec3 bc_screen = bc_center + offset[s];
+                if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0) continue;
+                if (!center_covered) { // shade at a covered sample rather than extrapolating past the edge
+                    bc_shade = bc_screen;
+                    center_covered = true;
+                }
+                z[s] = bc_screen * ndc_z;
+                tested++;
+                if (z[s] <= depth[s]) continue;
+                passed |= 1u << s;
+            }
+            if (!passed) continue;
+            vec3 bc_clip = {bc_shade.x / clip[0].w, bc_shade.y / clip[1].w, bc_shade.z / clip[2].w};
+            bc_clip = bc_clip / (bc_clip.x + bc_clip.y + bc_clip.z);
+            shaded++;
+            auto [discard, color] = PROFILE_FRAGMENT(x, y, shader.fragment(face, bc_clip));
+            if (discard) continue;
+            for (int s = 0; s < S; s++)
+                if (passed & (1u << s)) depth[s] = z[s];
+            if (passed == full) { // fast path: the fragment owns the whole pixel, a single colour is enough
+                pixel_split[idx] = 0;
+                framebuffer.set(x, y, color);
+                continue;
+            }
+            std::uint32_t *samples = split_colors(idx);
+            if (!pixel_split[idx]) {
+                std::fill(samples, samples + S, pack(framebuffer.get(x, y)));
+                pixel_split[idx] = 1;
+            }
+            for (int s = 0; s < S; s++)
+                if (passed & (1u << s)) samples[s] = pack(color);
+        }
+    }
+    PROFILE_COUNT(DEPTH_TESTS, tested);
+    PROFILE_COUNT(FRAGMENTS_SHADED, shaded);
+}
+
+// rasterizes the part of the triangle inside [x0,x1]x[y0,y1] on the calling thread
+static void rasterize_rect(const Triangle &clip, const int face, const TriangleSetup &t, int x0, int x1, int y0, int y1,
+                           const IShader &shader, TGAImage &framebuffer) {
+    x0 = std::max(x0, t.bbminx); x1 = std::min(x1, t.bbmaxx);
+    y0 = std::max(y0, t.bbminy); y1 = std::min(y1, t.bbmaxy);
+    if (msaa_samples > 1) {
+        rasterize_msaa(clip, face, t, x0, x1, y0, y1, shader, framebuffer);
+        return;
+    }
+
+    long tested = 0, shaded = 0;
+    for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) {
+            vec3 bc_screen = t.bc_transform * vec3{static_cast<double>(x), static_cast<double>(y), 1.};
             vec3 bc_clip = {bc_screen.x / clip[0].w, bc_screen.y / clip[1].w, bc_screen.z / clip[2].w};
             bc_clip = bc_clip / (bc_clip.x + bc_clip.y + bc_clip.z);
             if (bc_screen.x < 0 || bc_screen.y < 0 || bc_screen.z < 0) continue;
-            double z = bc_screen * vec3{ndc[0].z, ndc[1].z, ndc[2].z};
+            double z = bc_screen * vec3{t.ndc[0].z, t.ndc[1].z, t.ndc[2].z};
+            tested++;
             if (z <= zbuffer[x + y * framebuffer.width()]) continue;
-            auto [discard, color] = shader.fragment(bc_clip);
+            shaded++;
+            auto [discard, color] = PROFILE_FRAGMENT(x, y, shader.fragment(face, bc_clip));
             if (discard) continue;
             zbuffer[x + y * framebuffer.width()] = z;
             framebuffer.set(x, y, color);
         }
     }
-}
\ No newline at end of file
+    PROFILE_COUNT(DEPTH_TESTS, tested);
+    PROFILE_COUNT(FRAGMENTS_SHADED, shaded);
+}
+
+void rasterize(const Triangle &clip, const IShader &shader, TGAImage &framebuffer) {
+    PROFILE_COUNT(TRIANGLES_SUBMITTED, 1);
+    TriangleSetup t;
+    if (!setup_triangle(clip, framebuffer, t)) return;
+    parallel_for(t.bbminx, t.bbmaxx + 1, 8, [&](const int x) {
+        rasterize_rect(clip, -1, t, x, x, t.bbminy, t.bbmaxy, shader, framebuffer);
+    });
+}
+
+std::size_t raster_bytes_per_triangle() {
+    return sizeof(TriangleSetup) + sizeof(std::uint8_t) + sizeof(int); // setup, visibility flag, one tile bin entry
+}
+
+void rasterize(const std::vector<Triangle> &clips, const IShader &shader, TGAImage &framebuffer, const int first_face) {
+    PROFILE_SCOPE("rasterize");
+    constexpr int tile = 32;
+    const int nclips = clips.size();
+    PROFILE_COUNT(TRIANGLES_SUBMITTED, nclips);
+    const int tiles_x = (framebuffer.width()  + tile - 1) / tile;
+    const int tiles_y = (framebuffer.height() + tile - 1) / tile;
+    std::vector<TriangleSetup> setups(std::min(nclips, raster_batch));
+    std::vector<std::uint8_t> visible(setups.size());
+    std::vector<std::vector<int>> bins(tiles_x * tiles_y);
+
+    // the batches are drawn one after another, so the scratch memory does not grow with the model
+    for (int first = 0; first < nclips; first += raster_batch) {
+        const int n = std::min(raster_batch, nclips - first);
+        {
+            PROFILE_SCOPE("triangle setup");
+            parallel_for(0, n, 256, [&](const int i) {
+                visible[i] = setup_triangle(clips[first + i], framebuffer, setups[i]);
+            });
+        }
+
+        // bin the triangles by screen tile, the tiles are then rasterized independently, each one in submission order
+        for (std::vector<int> &bin : bins) bin.clear();
+        for (int i = 0; i < n; i++) {
+            if (!visible[i]) continue;
+            const TriangleSetup &t = setups[i];
+            for (int ty = t.bbminy / tile; ty <= t.bbmaxy / tile; ty++)
+                for (int tx = t.bbminx / tile; tx <= t.bbmaxx / tile; tx++)
+                    bins[tx + ty * tiles_x].push_back(i);
+        }
+
+        parallel_for(0, tiles_x * tiles_y, 1, [&](const int b) {
+            if (bins[b].empty()) return;
+            PROFILE_SCOPE("tile");
+            const int x0 = (b % tiles_x) * tile, y0 = (b / tiles_x) * tile;
+            for (int i : bins[b])
+                rasterize_rect(clips[first + i], first_face + first + i, setups[i], x0, x0 + tile - 1, y0, y0 + tile - 1, shader, framebuffer);
+        });
+    }
+}
@@ -1,18 +1,38 @@
+#include <array>
+#include <cstddef>
+#include <vector>
 #include "tgaimage.h"
 #include "linalg.h"
+#include "scheduler.h"
 
 void lookat(const vec3 eye, const vec3 center, const vec3 up);
 void init_perspective(const double f);
 void init_viewport(const int x, const int y, const int w, const int h);
-void init_zbuffer(const int width, const int height);
+void init_zbuffer(const int width, const int height, const int samples = 1); // samples: 1, 2, 4 or 8 for MSAA
+void resolve_msaa(TGAImage &framebuffer); // averages the sample colours into the framebuffer, the zbuffer gets the nearest sample depth
+void ambient_occlusion(TGAImage &framebuffer, const double radius, const int nsamples, const unsigned seed); // SSAO from the zbuffer
 
 struct IShader {
     struct TGAColor sample2D(const TGAImage &img, const vec2 &uvf) const {
         return img.get(uvf[0] * img.width(), uvf[1] * img.height());
     };
     
-    virtual std::pair<bool, TGAColor> fragment(const vec3 bar) const = 0;
+    virtual vec4 vertex(const vec4 v) const; // object space to clip space through ModelView and Perspective
+    // face is the index of the face in the batched rasterize(), and -1 for the single-triangle rasterize():
+    // shaders that look up per-face data with it can only be drawn by the batched one
+    virtual std::pair<bool, TGAColor> fragment(const int face, const vec3 bar) const = 0;
 };
 
-typedef vec4 Triangle[3];
-void rasterize(const Triangle &clip, const IShader &shader, TGAImage &framebuffer);
\ No newline at end of file
+typedef std::array<vec4, 3> Triangle;
+constexpr int raster_batch = 1 << 16; // triangles set up and binned at a time by the batched rasterize()
+std::size_t raster_bytes_per_triangle(); // scratch memory the batched rasterize() needs per triangle
+void rasterize(const Triangle &clip, const IShader &shader, TGAImage &framebuffer); // the shader gets face -1
+void rasterize(const std::vector<Triangle> &clips, const IShader &shader, TGAImage &framebuffer, const int first_face = 0); // screen-binned, same result as one call per triangle in order; clips[i] is the face first_face+i
+
+// the vertex stage: clips[i] receives the face first+i, position(face, nthvert) returns its object-space vertices
+template<typename F> void vertex_stage(const IShader &shader, const int first, const int nfaces, std::vector<Triangle> &clips, F&& position) {
+    clips.resize(nfaces);
+    parallel_for(0, nfaces, 1024, [&](const int i) {
+        for (int v = 0; v < 3; v++) clips[i][v] = shader.vertex(position(first + i, v));
+    });
+}
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "profile.h"
+#include "tgaimage.h"
+
+bool Profiler::enabled  = false;
+bool Profiler::heatmaps = false;
+
+struct TraceEvent {
+    const char *name;
+    std::string detail;
+    std::int64_t start_us, duration_us;
+};
+
+struct ThreadRecord { // written by its thread only, read once the frame is done
+    int tid = 0;
+    std::string name = {};
+    long counters[NCOUNTERS] = {};
+    std::vector<TraceEvent> events = {};
+};
+
+static std::mutex records_mtx;
+static std::vector<std::unique_ptr<ThreadRecord>> records; // outlive their threads
+static const auto epoch = std::chrono::steady_clock::now();
+
+static std::vector<std::uint32_t> overdraw; // fragments shaded per pixel
+static std::vector<std::uint64_t> cost;     // nanoseconds spent shading per pixel
+static int heatmap_width = 0;
+
+static ThreadRecord &thread_record() {
+    thread_local ThreadRecord *record = nullptr;
+    if (!record) {
+        std::lock_guard<std::mutex> lock(records_mtx);
+        records.push_back(std::make_unique<ThreadRecord>());
+        record = records.back().get();
+        record->tid = records.size() - 1;
+    }
+    return *record;
+}
+
+void Profiler::name_thread(const std::string &name) {
+    thread_record().name = name;
+}
+
+void Profiler::count(const Counter counter, const long n) {
+    thread_record().counters[counter] += n;
+}
+
+long Profiler::total(const Counter counter) {
+    std::lock_guard<std::mutex> lock(records_mtx);
+    long ret = 0;
+    for (const auto &record : records) ret += record->counters[counter];
+    return ret;
+}
+
+const char *Profiler::name(const Counter counter) {
+    constexpr const char *names[NCOUNTERS] = {"triangles_submitted", "triangles_culled", "triangles_offscreen",
+                                              "depth_tests", "fragments_shaded", "ao_samples"};
+    return names[counter];
+}
+
+void Profiler::init_heatmaps(const int width, const int height) {
+    heatmaps = true;
+    heatmap_width = width;
+    overdraw = std::vector<std::uint32_t>(width * height, 0);
+    cost = std::vector<std::uint64_t>(width * height, 0);
+}
+
+void Profiler::shaded(const int x, const int y, const std::int64_t ns) { // a pixel belongs to a single thread at a time
+    overdraw[x + y * heatmap_width]++;
+    cost[x + y * heatmap_width] += ns;
+}
+
+void ScopedTimer::begin(const char *name, const std::string_view detail) {
+    this->name = name;
+    this->detail = detail;
+    start = std::chrono::steady_clock::now();
+}
+
+void ScopedTimer::end() {
+    auto now = std::chrono::steady_clock::now();
+    auto us = [](auto d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+    thread_record().events.push_back({name, std::move(detail), us(start - epoch), us(now - start)});
+}
+
+static std::string escape(const std::string &s) {
+    std::string ret;
+    for (char c : s) {
+        if (c == '"' || c == '\\') ret += '\\';
+        ret += c;
+    }
+    return ret;
+}
+
+bool Profiler::write_trace(const std::string filename) {
+    std::ofstream out(filename);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << filename << "\n";
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(records_mtx);
+    std::int64_t end_us = 0;
+    long totals[NCOUNTERS] = {};
+    out << "{\"traceEvents\": [\n";
+    for (const auto &record : records) {
+        out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << record->tid
+            << ", \"args\": {\"name\": \"" << escape(record->name.empty() ? "thread " + std::to_string(record->tid) : record->name) << "\"}},\n";
+        for (const TraceEvent &e : record->events) {
+            out << "  {\"name\": \"" << e.name << "\", \"cat\": \"tinyrenderer\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << record->tid
+                << ", \"ts\": " << e.start_us << ", \"dur\": " << e.duration_us;
+            if (!e.detail.empty()) out << ", \"args\": {\"detail\": \"" << escape(e.detail) << "\"}";
+            out << "},\n";
+            end_us = std::max(end_us, e.start_us + e.duration_us);
+        }
+        for (int c = 0; c < NCOUNTERS; c++) totals[c] += record->counters[c];
+    }
+    out << "  {\"name\": \"counters\", \"ph\": \"C\", \"pid\": 1, \"tid\": 0, \"ts\": " << end_us << ", \"args\": {";
+    for (int c = 0; c < NCOUNTERS; c++)
+        out << "\"" << name(Counter(c)) << "\": " << totals[c] << (c + 1 < NCOUNTERS ? ", " : "");
+    out << "}}\n], \"displayTimeUnit\": \"ms\"}\n";
+    if (!out.good()) {
+        std::cerr << "can't dump the trace file\n";
+        return false;
+    }
+    return true;
+}
+
+// black -> red -> yellow -> white
+static TGAColor heat(const double t) {
+    auto channel = [t](const double from) { return static_cast<std::uint8_t>(std::clamp((t - from) * 3., 0., 1.) * 255); };
+    return {channel(2 / 3.), channel(1 / 3.), channel(0), 255};
+}
+
+template<typename T> static bool write_heatmap(const std::vector<T> &values, const std::string filename) {
+    std::vector<T> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    double scale = sorted.empty() ? 0 : static_cast<double>(sorted[sorted.size() * 999 / 1000]); // a few hot pixels must not wash out the map
+    if (scale <= 0) scale = sorted.empty() ? 1 : std::max<double>(1, sorted.back());
+    const int h = values.size() / std::max(heatmap_width, 1);
+    TGAImage img(heatmap_width, h, TGAImage::RGB);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < heatmap_width; x++)
+            img.set(x, y, heat(values[x + y * heatmap_width] / scale));
+    return img.write_tga_file(filename);
+}
+
+bool Profiler::write_heatmaps(const std::string overdraw_filename, const std::string cost_filename) {
+    return write_heatmap(overdraw, overdraw_filename) && write_heatmap(cost, cost_filename);
+}
+
+void Profiler::print_counters() {
+    for (int c = 0; c < NCOUNTERS; c++)
+        std::cerr << name(Counter(c)) << ": " << total(Counter(c)) << "\n";
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Instrumentation of the renderer stages: per-thread counters, scoped timers exported as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev), and per-pixel overdraw / shading cost heat maps.
+// Compiled in with the TINYRENDERER_PROFILE definition, then switched on at run time; while it is off
+// every probe costs a single test of a global flag.
+
+enum Counter { TRIANGLES_SUBMITTED, TRIANGLES_CULLED, TRIANGLES_OFFSCREEN, DEPTH_TESTS, FRAGMENTS_SHADED, AO_SAMPLES, NCOUNTERS };
+
+struct Profiler {
+    static bool enabled;  // counters and timers
+    static bool heatmaps; // per-pixel fragment count and shading time, costs two clock reads per fragment
+
+    static void name_thread(const std::string &name); // labels the calling thread in the trace
+    static void count(const Counter counter, const long n);
+    static long total(const Counter counter);
+    static const char *name(const Counter counter);
+
+    static void init_heatmaps(const int width, const int height);
+    static void shaded(const int x, const int y, const std::int64_t ns);
+
+    static bool write_trace(const std::string filename);
+    static bool write_heatmaps(const std::string overdraw_filename, const std::string cost_filename);
+    static void print_counters();
+};
+
+// the flag is tested inline, the detail is only copied when the profiler is on
+class ScopedTimer {
+public:
+    ScopedTimer(const char *name, const std::string_view detail = {}) {
+        if (Profiler::enabled) begin(name, detail);
+    }
+    ~ScopedTimer() {
+        if (name) end();
+    }
+private:
+    void begin(const char *name, const std::string_view detail);
+    void end();
+    const char *name = nullptr; // set while the timer runs
+    std::string detail = {};
+    std::chrono::steady_clock::time_point start = {};
+};
+
+template<typename F> auto profile_fragment(const int x, const int y, F&& fragment) {
+    if (!Profiler::heatmaps) return fragment();
+    auto start = std::chrono::steady_clock::now();
+    auto ret = fragment();
+    Profiler::shaded(x, y, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    return ret;
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef TINYRENDERER_PROFILE
+#define PROFILE_SCOPE(...) ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(__VA_ARGS__)
+#define PROFILE_COUNT(counter, n) do { if (Profiler::enabled) Profiler::count(counter, n); } while (0)
+#define PROFILE_THREAD(name) Profiler::name_thread(name)
+#define PROFILE_FRAGMENT(x, y, expr) profile_fragment(x, y, [&] { return expr; })
+#else
+#define PROFILE_SCOPE(...) do {} while (0)
+#define PROFILE_COUNT(counter, n) do {} while (0)
+#define PROFILE_THREAD(name) do {} while (0)
+#define PROFILE_FRAGMENT(x, y, expr) (expr)
+#endif
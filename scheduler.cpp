@@ -0,0 +1,126 @@
+#include <string>
+#include "scheduler.h"
+#include "profile.h"
+
+thread_local int worker_id = -1; // index of the queue owned by the current thread, -1 outside the pool
+
+Scheduler& Scheduler::instance() {
+    static Scheduler scheduler(std::max<int>(std::thread::hardware_concurrency(), 1) - 1); // the waiting thread makes up the last core
+    return scheduler;
+}
+
+Scheduler::Scheduler(const int nworkers) {
+    for (int i = 0; i <= nworkers; i++) queues.push_back(std::make_unique<Queue>());
+    for (int i = 0; i < nworkers; i++) workers.emplace_back(&Scheduler::work, this, i);
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mtx);
+        stop = true;
+    }
+    sleep_cv.notify_all();
+    for (std::thread& t : workers) t.join();
+}
+
+int Scheduler::nthreads() const { return static_cast<int>(workers.size()) + 1; }
+
+TaskHandle Scheduler::submit(std::function<void()> fn, const std::vector<TaskHandle>& deps) {
+    TaskHandle task = std::make_shared<Task>();
+    task->fn = std::move(fn);
+    for (const TaskHandle& dep : deps) {
+        std::lock_guard<std::mutex> lock(dep->mtx);
+        if (dep->done) continue;
+        task->pending++;
+        dep->successors.push_back(task);
+    }
+    if (!--task->pending) push(task);
+    return task;
+}
+
+void Scheduler::wait(const TaskHandle& task) {
+    constexpr int max_spins = 64;
+    for (int spins = 0; !task->done; ) {
+        if (run_one()) {
+            spins = 0;
+            continue;
+        }
+        if (++spins < max_spins) {
+            std::this_thread::yield();
+            continue;
+        }
+        // nothing to help with, the task runs elsewhere or waits for its dependencies: sleep until it is done or work shows up
+        std::unique_lock<std::mutex> lock(sleep_mtx);
+        waiting++;
+        wake_cv.wait(lock, [&] { return task->done || queued > 0; });
+        waiting--;
+        spins = 0;
+    }
+}
+
+void Scheduler::push(TaskHandle task) {
+    Queue& queue = *queues[worker_id < 0 ? queues.size() - 1 : worker_id];
+    {
+        std::lock_guard<std::mutex> lock(queue.mtx);
+        queue.tasks.push_back(std::move(task));
+    }
+    queued++;
+    { std::lock_guard<std::mutex> lock(sleep_mtx); } // a worker checking `queued` under this lock cannot miss the notification
+    sleep_cv.notify_one();
+    if (waiting) wake_cv.notify_all();
+}
+
+TaskHandle Scheduler::pop() {
+    const int nqueues = queues.size();
+    if (worker_id >= 0) { // newest own task first, it is the most likely to be in cache
+        Queue& own = *queues[worker_id];
+        std::lock_guard<std::mutex> lock(own.mtx);
+        if (!own.tasks.empty()) {
+            TaskHandle task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return task;
+        }
+    }
+    const int first = worker_id < 0 ? nqueues - 1 : worker_id + 1;
+    for (int i = 0; i < nqueues; i++) { // steal the oldest task, it tends to carry the most work
+        Queue& victim = *queues[(first + i) % nqueues];
+        std::lock_guard<std::mutex> lock(victim.mtx);
+        if (victim.tasks.empty()) continue;
+        TaskHandle task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return task;
+    }
+    return nullptr;
+}
+
+bool Scheduler::run_one() {
+    TaskHandle task = pop();
+    if (!task) return false;
+    queued--;
+    task->fn();
+    task->fn = nullptr; // releases whatever the task captured
+    std::vector<TaskHandle> successors;
+    {
+        std::lock_guard<std::mutex> lock(task->mtx);
+        task->done = true;
+        successors.swap(task->successors);
+    }
+    if (waiting) { // either this sees the waiter, or the waiter sees `done` before it sleeps
+        { std::lock_guard<std::mutex> lock(sleep_mtx); }
+        wake_cv.notify_all();
+    }
+    for (TaskHandle& next : successors)
+        if (!--next->pending) push(std::move(next));
+    return true;
+}
+
+void Scheduler::work(const int id) {
+    worker_id = id;
+    PROFILE_THREAD("worker " + std::to_string(id));
+    while (true) {
+        if (run_one()) continue;
+        std::unique_lock<std::mutex> lock(sleep_mtx);
+        sleep_cv.wait(lock, [this] { return stop || queued > 0; });
+        if (stop && !queued) return;
+    }
+}
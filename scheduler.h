@@ -0,0 +1,78 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Task {
+    std::function<void()> fn = {};
+    std::atomic<int> pending = 1;   // unfinished dependencies, plus one held by submit() until the task is wired up
+    std::atomic<bool> done = false;
+    std::mutex mtx = {};
+    std::vector<std::shared_ptr<Task>> successors = {};
+};
+typedef std::shared_ptr<Task> TaskHandle;
+
+// Work-stealing job system shared by every stage of the frame.
+// Each worker pushes and pops its own tasks LIFO and steals the oldest tasks of the others; threads outside
+// the pool submit to a separate queue. A thread waiting for a task keeps running queued tasks instead of blocking,
+// so nested parallel_for calls share the same workers and never oversubscribe the cores; once there is nothing
+// left to run it spins briefly, then sleeps until the task completes or new work is queued.
+class Scheduler {
+public:
+    static Scheduler& instance();
+
+    explicit Scheduler(const int nworkers);
+    ~Scheduler();
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // the task becomes runnable once all of its dependencies are done
+    TaskHandle submit(std::function<void()> fn, const std::vector<TaskHandle>& deps = {});
+    void wait(const TaskHandle& task);
+
+    int nthreads() const; // the workers plus the thread that waits
+
+private:
+    struct Queue {
+        std::mutex mtx = {};
+        std::deque<TaskHandle> tasks = {};
+    };
+
+    void push(TaskHandle task);
+    TaskHandle pop();
+    bool run_one();
+    void work(const int id);
+
+    std::vector<std::unique_ptr<Queue>> queues = {}; // one per worker, the last one is fed by the other threads
+    std::vector<std::thread> workers = {};
+    std::atomic<int> queued = 0;
+    std::mutex sleep_mtx = {};
+    std::condition_variable sleep_cv = {}; // idle workers
+    std::condition_variable wake_cv = {};  // threads blocked in wait()
+    std::atomic<int> waiting = 0;
+    bool stop = false;
+};
+
+// calls body(i) for every i in [begin, end), in chunks of at least grain indices
+template<typename F> void parallel_for(const int begin, const int end, const int grain, F&& body) {
+    Scheduler& scheduler = Scheduler::instance();
+    const int n = end - begin;
+    const int chunk = std::max({grain, 1, (n + 4 * scheduler.nthreads() - 1) / (4 * scheduler.nthreads())});
+    if (n <= chunk) {
+        for (int i = begin; i < end; i++) body(i);
+        return;
+    }
+    std::vector<TaskHandle> tasks;
+    for (int first = begin + chunk; first < end; first += chunk)
+        tasks.push_back(scheduler.submit([&body, first, last = std::min(first + chunk, end)] {
+            for (int i = first; i < last; i++) body(i);
+        }));
+    for (int i = begin; i < begin + chunk; i++) body(i); // the first chunk runs on the calling thread
+    for (const TaskHandle& task : tasks) scheduler.wait(task);
+}
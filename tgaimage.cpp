@@ -1,6 +1,9 @@
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 #include "tgaimage.h"
+#include "scheduler.h"
+#include "profile.h"
 
 TGAImage::TGAImage(const int w, const int h, const int bpp, TGAColor c) : w(w), h(h), bpp(bpp), data(w*h*bpp, 0) {
     for (int j=0; j<h; j++)
@@ -9,6 +12,7 @@ TGAImage::TGAImage(const int w, const int h, const int bpp, TGAColor c) : w(w),
 }
 
 bool TGAImage::read_tga_file(const std::string filename) {
+    PROFILE_SCOPE("TGAImage::read_tga_file", filename);
     std::ifstream in;
     in.open(filename, std::ios::binary);
     if (!in.is_open()) {
@@ -53,56 +57,68 @@ bool TGAImage::read_tga_file(const std::string filename) {
     return true;
 }
 
+// the packet boundaries are found by one serial pass over the headers, then the bands of packets are expanded in parallel
 bool TGAImage::load_rle_data(std::ifstream &in) {
-    size_t pixelcount = w*h;
-    size_t currentpixel = 0;
-    size_t currentbyte  = 0;
-    TGAColor colorbuffer;
-    do {
-        std::uint8_t chunkheader = 0;
-        chunkheader = in.get();
-        if (!in.good()) {
+    const size_t pixelcount = w*h;
+    const std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::vector<std::uint8_t> rle(static_cast<size_t>(in.tellg() - start));
+    in.seekg(start);
+    in.read(reinterpret_cast<char *>(rle.data()), rle.size());
+    if (!in.good()) {
+        std::cerr << "an error occured while reading the data\n";
+        return false;
+    }
+
+    struct Band { size_t src, pixel; }; // first packet of the band in rle, and its first pixel
+    std::vector<Band> bands;
+    const size_t band_pixels = 64 * w;
+    size_t src = 0, pixel = 0;
+    for (size_t next_band = 0; pixel < pixelcount; ) {
+        if (pixel >= next_band) {
+            bands.push_back({src, pixel});
+            next_band = pixel + band_pixels;
+        }
+        if (src >= rle.size()) {
             std::cerr << "an error occured while reading the data\n";
             return false;
         }
-        if (chunkheader<128) {
-            chunkheader++;
-            for (int i=0; i<chunkheader; i++) {
-                in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-                if (!in.good()) {
-                    std::cerr << "an error occured while reading the header\n";
-                    return false;
-                }
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
-            }
-        } else {
-            chunkheader -= 127;
-            in.read(reinterpret_cast<char *>(colorbuffer.bgra), bpp);
-            if (!in.good()) {
-                std::cerr << "an error occured while reading the header\n";
-                return false;
-            }
-            for (int i=0; i<chunkheader; i++) {
-                for (int t=0; t<bpp; t++)
-                    data[currentbyte++] = colorbuffer.bgra[t];
-                currentpixel++;
-                if (currentpixel>pixelcount) {
-                    std::cerr << "Too many pixels read\n";
-                    return false;
-                }
+        std::uint8_t chunkheader = rle[src++];
+        size_t npixels = chunkheader<128 ? chunkheader + 1 : chunkheader - 127;
+        src += chunkheader<128 ? npixels*bpp : bpp;
+        pixel += npixels;
+        if (src > rle.size()) {
+            std::cerr << "an error occured while reading the header\n";
+            return false;
+        }
+        if (pixel > pixelcount) {
+            std::cerr << "Too many pixels read\n";
+            return false;
+        }
+    }
+    bands.push_back({src, pixel});
+
+    parallel_for(0, bands.size() - 1, 1, [&](const int b) {
+        size_t currentbyte = bands[b].pixel*bpp;
+        for (size_t src = bands[b].src; src < bands[b + 1].src; ) {
+            std::uint8_t chunkheader = rle[src++];
+            if (chunkheader<128) {
+                size_t nbytes = (chunkheader + 1)*bpp;
+                std::copy_n(rle.begin() + src, nbytes, data.begin() + currentbyte);
+                src += nbytes;
+                currentbyte += nbytes;
+            } else {
+                for (int i=chunkheader-127; i--; currentbyte += bpp)
+                    std::copy_n(rle.begin() + src, bpp, data.begin() + currentbyte);
+                src += bpp;
             }
         }
-    } while (currentpixel < pixelcount);
+    });
     return true;
 }
 
 bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
+    PROFILE_SCOPE("TGAImage::write_tga_file", filename);
     constexpr std::uint8_t developer_area_ref[4] = {0, 0, 0, 0};
     constexpr std::uint8_t extension_area_ref[4] = {0, 0, 0, 0};
     constexpr std::uint8_t footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
@@ -137,9 +153,24 @@ err:
 }
 
 bool TGAImage::unload_rle_data(std::ofstream &out) const {
+    constexpr size_t band_rows = 64;   // the bands are encoded in parallel, packets never cross a band boundary
+    const size_t nbands = (h + band_rows - 1) / band_rows;
+    std::vector<std::vector<std::uint8_t>> bands(nbands);
+    parallel_for(0, nbands, 1, [&](const int i) {
+        encode_rle_data(i * band_rows * w, std::min<size_t>((i + 1) * band_rows, h) * w, bands[i]);
+    });
+    for (const std::vector<std::uint8_t> &band : bands) {
+        out.write(reinterpret_cast<const char *>(band.data()), band.size());
+        if (!out.good()) return false;
+    }
+    return true;
+}
+
+void TGAImage::encode_rle_data(const size_t first, const size_t last, std::vector<std::uint8_t> &out) const {
+    PROFILE_SCOPE("rle band");
     const std::uint8_t max_chunk_length = 128;
-    size_t npixels = w*h;
-    size_t curpix = 0;
+    size_t npixels = last;
+    size_t curpix = first;
     while (curpix<npixels) {
         size_t chunkstart = curpix*bpp;
         size_t curbyte = curpix*bpp;
@@ -161,12 +192,9 @@ bool TGAImage::unload_rle_data(std::ofstream &out) const {
             run_length++;
         }
         curpix += run_length;
-        out.put(raw ? run_length-1 : run_length+127);
-        if (!out.good()) return false;
-        out.write(reinterpret_cast<const char *>(data.data()+chunkstart), (raw?run_length*bpp:bpp));
-        if (!out.good()) return false;
+        out.push_back(raw ? run_length-1 : run_length+127);
+        out.insert(out.end(), data.begin()+chunkstart, data.begin()+chunkstart+(raw?run_length*bpp:bpp));
     }
-    return true;
 }
 
 TGAColor TGAImage::get(const int x, const int y) const {
@@ -183,17 +211,17 @@ void TGAImage::set(int x, int y, const TGAColor &c) {
 }
 
 void TGAImage::flip_horizontally() {
-    for (int i=0; i<w/2; i++)
-        for (int j=0; j<h; j++)
+    parallel_for(0, h, 16, [&](const int j) {
+        for (int i=0; i<w/2; i++)
             for (int b=0; b<bpp; b++)
                 std::swap(data[(i+j*w)*bpp+b], data[(w-1-i+j*w)*bpp+b]);
+    });
 }
 
 void TGAImage::flip_vertically() {
-    for (int i=0; i<w; i++)
-        for (int j=0; j<h/2; j++)
-            for (int b=0; b<bpp; b++)
-                std::swap(data[(i+j*w)*bpp+b], data[(i+(h-1-j)*w)*bpp+b]);
+    parallel_for(0, h/2, 16, [&](const int j) {
+        std::swap_ranges(data.begin()+j*w*bpp, data.begin()+(j+1)*w*bpp, data.begin()+(h-1-j)*w*bpp);
+    });
 }
 
 int TGAImage::width() const {